@@ -0,0 +1,157 @@
+#include "batching.h"
+
+class BatchingExecutor::BatchTask : public Task {
+public:
+    BatchTask(BatchingExecutor* owner, std::vector<std::shared_ptr<Task>> batch)
+        : owner(owner), tasks(std::move(batch)) {}
+
+    void run() override {
+        owner->RunBatch(&tasks);
+    }
+
+    BatchingExecutor* owner;
+    std::vector<std::shared_ptr<Task>> tasks;
+};
+
+BatchingExecutor::BatchingExecutor(std::shared_ptr<Executor> executor, size_t max_batch_size,
+                                   std::chrono::microseconds max_delay)
+    : executor_(std::move(executor)),
+      max_batch_size_(std::max<size_t>(max_batch_size, 1)),
+      max_delay_(max_delay) {
+    timer_ = std::thread([this]() { RunTimer(); });
+}
+
+BatchingExecutor::~BatchingExecutor() {
+    startShutdown();
+    waitShutdown();
+}
+
+void BatchingExecutor::submit(std::shared_ptr<Task> task) {
+    if (!task) {
+        return;
+    }
+    std::unique_lock<std::mutex> task_guard(task->task_mutex_);
+    bool plain = !task->has_dependencies_ && !task->has_trigger_ && !task->has_deadline_;
+    task_guard.unlock();
+
+    std::unique_lock<std::mutex> guard(batch_mutex_);
+    if (!turned_on_) {
+        guard.unlock();
+        task->cancel();
+        return;
+    }
+    if (!plain) {
+        guard.unlock();
+        executor_->submit(std::move(task));
+        return;
+    }
+
+    if (batch_.empty()) {
+        batch_deadline_ = std::chrono::steady_clock::now() + max_delay_;
+        timer_cv_.notify_one();
+    }
+    batch_.push_back(std::move(task));
+    if (batch_.size() < max_batch_size_) {
+        return;
+    }
+    auto batch = TakeBatch();
+    guard.unlock();
+    Dispatch(std::move(batch));
+}
+
+void BatchingExecutor::flush() {
+    std::unique_lock<std::mutex> guard(batch_mutex_);
+    auto batch = TakeBatch();
+    guard.unlock();
+    Dispatch(std::move(batch));
+}
+
+std::vector<std::shared_ptr<Task>> BatchingExecutor::TakeBatch() {
+    auto batch = std::move(batch_);
+    batch_.clear();
+    if (!batch.empty()) {
+        ++batches_in_flight_;
+    }
+    return batch;
+}
+
+void BatchingExecutor::Dispatch(std::vector<std::shared_ptr<Task>> batch) {
+    if (batch.empty()) {
+        return;
+    }
+    auto batch_task = std::make_shared<BatchTask>(this, std::move(batch));
+    executor_->submit(batch_task);
+    // the underlying executor is shutting down and refused the batch
+    if (batch_task->isCanceled()) {
+        for (auto& task : batch_task->tasks) {
+            task->cancel();
+        }
+        BatchFinished();
+    }
+}
+
+void BatchingExecutor::RunBatch(std::vector<std::shared_ptr<Task>>* tasks) {
+    for (auto& task : *tasks) {
+        task->Process();
+    }
+    tasks->clear();
+    BatchFinished();
+}
+
+void BatchingExecutor::BatchFinished() {
+    std::unique_lock<std::mutex> guard(batch_mutex_);
+    --batches_in_flight_;
+    batches_cv_.notify_all();
+}
+
+void BatchingExecutor::RunTimer() {
+    std::unique_lock<std::mutex> guard(batch_mutex_);
+    while (turned_on_) {
+        if (batch_.empty()) {
+            timer_cv_.wait(guard);
+            continue;
+        }
+        if (std::chrono::steady_clock::now() < batch_deadline_) {
+            timer_cv_.wait_until(guard, batch_deadline_);
+            continue;
+        }
+        auto batch = TakeBatch();
+        guard.unlock();
+        Dispatch(std::move(batch));
+        guard.lock();
+    }
+}
+
+void BatchingExecutor::startShutdown() {
+    std::unique_lock<std::mutex> guard(batch_mutex_);
+    if (!turned_on_) {
+        return;
+    }
+    turned_on_ = false;
+    timer_cv_.notify_all();
+    // tasks submitted before shutdown still run
+    auto batch = TakeBatch();
+    guard.unlock();
+    Dispatch(std::move(batch));
+}
+
+void BatchingExecutor::waitShutdown() {
+    std::unique_lock<std::mutex> shutdown_guard(shutdown_mutex_);
+    if (timer_.joinable()) {
+        timer_.join();
+    }
+    std::unique_lock<std::mutex> guard(batch_mutex_);
+    while (batches_in_flight_ != 0) {
+        batches_cv_.wait(guard);
+    }
+}
+
+std::shared_ptr<Executor> BatchingExecutor::blockingExecutor() {
+    return executor_->blockingExecutor();
+}
+
+std::shared_ptr<Executor> MakeBatchingExecutor(std::shared_ptr<Executor> executor,
+                                               size_t max_batch_size,
+                                               std::chrono::microseconds max_delay) {
+    return std::make_shared<BatchingExecutor>(std::move(executor), max_batch_size, max_delay);
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "executors.h"
+
+// Adapter for lots of tiny tasks: ready tasks are gathered into batches and every
+// batch goes to the underlying executor as one Task, which runs them one after
+// another. A batch is sent once it has max_batch_size tasks or max_delay after
+// its first task came. Every task still completes, fails or gets canceled on its
+// own. Tasks with dependencies, triggers or deadlines are passed through as is.
+class BatchingExecutor : public Executor {
+public:
+    BatchingExecutor(std::shared_ptr<Executor> executor, size_t max_batch_size,
+                     std::chrono::microseconds max_delay);
+    ~BatchingExecutor() override;
+
+    void submit(std::shared_ptr<Task> task) override;
+
+    // sends the current batch without waiting for it to fill
+    void flush();
+
+    // doesn't shut down the underlying executor, only waits for own batches
+    void startShutdown() override;
+    void waitShutdown() override;
+
+    std::shared_ptr<Executor> blockingExecutor() override;
+
+private:
+    class BatchTask;
+
+    // must be called with batch_mutex_ locked, returns the batch to dispatch
+    std::vector<std::shared_ptr<Task>> TakeBatch();
+    void Dispatch(std::vector<std::shared_ptr<Task>> batch);
+    void RunBatch(std::vector<std::shared_ptr<Task>>* tasks);
+    void BatchFinished();
+    void RunTimer();
+
+    std::shared_ptr<Executor> executor_;
+    const size_t max_batch_size_;
+    const std::chrono::microseconds max_delay_;
+
+    std::mutex batch_mutex_, shutdown_mutex_;
+    std::condition_variable timer_cv_, batches_cv_;
+    std::vector<std::shared_ptr<Task>> batch_;
+    std::chrono::steady_clock::time_point batch_deadline_;
+    int batches_in_flight_ = 0;
+    bool turned_on_ = true;
+    std::thread timer_;
+};
+
+std::shared_ptr<Executor> MakeBatchingExecutor(std::shared_ptr<Executor> executor,
+                                               size_t max_batch_size,
+                                               std::chrono::microseconds max_delay);
@@ -0,0 +1,68 @@
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include "batching.h"
+
+namespace {
+const int kTasks = 10000;
+
+// busy for about work_ns, the way a small CPU-bound task would be
+void Spin(int64_t work_ns) {
+    if (work_ns == 0) {
+        return;
+    }
+    auto end = std::chrono::steady_clock::now() + std::chrono::nanoseconds(work_ns);
+    while (std::chrono::steady_clock::now() < end) {
+    }
+}
+
+// kTasks futures of work_ns each, each adds one to a counter
+void SubmitTasks(const std::shared_ptr<Executor>& executor, int64_t work_ns,
+                 std::atomic<int64_t>* counter) {
+    std::vector<FuturePtr<Unit>> futures;
+    futures.reserve(kTasks);
+    for (int ind = 0; ind < kTasks; ++ind) {
+        futures.push_back(executor->invoke<Unit>([counter, work_ns]() {
+            Spin(work_ns);
+            counter->fetch_add(1, std::memory_order_relaxed);
+            return Unit{};
+        }));
+    }
+    for (auto& future : futures) {
+        future->wait();
+    }
+}
+
+// per task work in ns, batching stops paying off somewhere in there
+const std::vector<int64_t> kWork = {0, 500, 1000, 2000, 10000};
+}  // namespace
+
+// args are pool threads and work per task
+static void BM_PoolTinyTasks(benchmark::State& state) {
+    auto pool = MakeThreadPoolExecutor(state.range(0));
+    std::atomic<int64_t> counter{0};
+    for (auto _ : state) {
+        SubmitTasks(pool, state.range(1), &counter);
+    }
+    state.SetItemsProcessed(state.iterations() * kTasks);
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+BENCHMARK(BM_PoolTinyTasks)->ArgsProduct({{1, 4}, kWork})->UseRealTime();
+
+// args are pool threads, max batch size and work per task
+static void BM_BatchingTinyTasks(benchmark::State& state) {
+    auto pool = MakeThreadPoolExecutor(state.range(0));
+    auto batching = MakeBatchingExecutor(pool, state.range(1), std::chrono::microseconds(100));
+    std::atomic<int64_t> counter{0};
+    for (auto _ : state) {
+        SubmitTasks(batching, state.range(2), &counter);
+    }
+    state.SetItemsProcessed(state.iterations() * kTasks);
+    batching->startShutdown();
+    batching->waitShutdown();
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+BENCHMARK(BM_BatchingTinyTasks)->ArgsProduct({{1, 4}, {8, 64, 512}, kWork})->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,106 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+// Bounded multi-producer multi-consumer queue. push() blocks while the channel
+// is full, which gives backpressure to fast producers, pop() blocks while it's
+// empty. After close() pushes fail and pops drain what's left.
+template <class T>
+class Channel {
+public:
+    // a zero capacity channel would block every push forever
+    explicit Channel(size_t capacity) : capacity_(capacity) {
+        if (capacity == 0) {
+            throw std::invalid_argument("Channel capacity must be positive");
+        }
+    }
+
+    // false if the channel was closed
+    bool push(T value) {
+        std::unique_lock<std::mutex> guard(channel_mutex_);
+        while (!closed_ && items_.size() >= capacity_) {
+            not_full_cv_.wait(guard);
+        }
+        if (closed_) {
+            return false;
+        }
+        items_.push_back(std::move(value));
+        not_empty_cv_.notify_one();
+        return true;
+    }
+
+    bool tryPush(T value) {
+        std::unique_lock<std::mutex> guard(channel_mutex_);
+        if (closed_ || items_.size() >= capacity_) {
+            return false;
+        }
+        items_.push_back(std::move(value));
+        not_empty_cv_.notify_one();
+        return true;
+    }
+
+    // std::nullopt if the channel was closed and is empty
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> guard(channel_mutex_);
+        while (!closed_ && items_.empty()) {
+            not_empty_cv_.wait(guard);
+        }
+        return TakeFront();
+    }
+
+    std::optional<T> tryPop() {
+        std::unique_lock<std::mutex> guard(channel_mutex_);
+        return TakeFront();
+    }
+
+    // waits for at least one item and takes up to max_count of them at once,
+    // empty result means the channel is closed and drained
+    std::vector<T> popBatch(size_t max_count) {
+        std::unique_lock<std::mutex> guard(channel_mutex_);
+        while (!closed_ && items_.empty()) {
+            not_empty_cv_.wait(guard);
+        }
+        std::vector<T> batch;
+        while (!items_.empty() && batch.size() < max_count) {
+            batch.push_back(std::move(items_.front()));
+            items_.pop_front();
+        }
+        if (!batch.empty()) {
+            not_full_cv_.notify_all();
+        }
+        return batch;
+    }
+
+    void close() {
+        std::unique_lock<std::mutex> guard(channel_mutex_);
+        closed_ = true;
+        not_empty_cv_.notify_all();
+        not_full_cv_.notify_all();
+    }
+
+    bool isClosed() {
+        std::unique_lock<std::mutex> guard(channel_mutex_);
+        return closed_;
+    }
+
+private:
+    std::optional<T> TakeFront() {
+        if (items_.empty()) {
+            return std::nullopt;
+        }
+        std::optional<T> value(std::move(items_.front()));
+        items_.pop_front();
+        not_full_cv_.notify_one();
+        return value;
+    }
+
+    const size_t capacity_;
+    std::mutex channel_mutex_;
+    std::condition_variable not_empty_cv_, not_full_cv_;
+    std::deque<T> items_;
+    bool closed_ = false;
+};
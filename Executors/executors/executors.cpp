@@ -22,11 +22,34 @@ void Task::setTimeTrigger(std::chrono::system_clock::time_point at) {
     has_deadline_ = true;
 }
 
+void Task::setCancelPropagation(CancelPropagation propagation) {
+    std::unique_lock<std::mutex> guard(task_mutex_);
+    propagation_ = propagation;
+}
+
+bool Task::CancelsWith(bool dep_canceled, bool dep_failed) const {
+    switch (propagation_) {
+        case CancelPropagation::Canceled:
+            return dep_canceled;
+        case CancelPropagation::CanceledOrFailed:
+            return dep_canceled || dep_failed;
+        default:
+            return false;
+    }
+}
+
 void Task::AddSlave(std::shared_ptr<Task> slave) {
     std::unique_lock<std::mutex> master_guard(task_mutex_);
     std::unique_lock<std::mutex> slave_guard(slave->task_mutex_);
     slave->has_dependencies_ = true;
     if (is_failed_ || is_canceled_ || is_completed_) {
+        bool cancel_slave = !slave->is_canceled_ && !slave->process_started_ &&
+                            slave->CancelsWith(is_canceled_, is_failed_);
+        slave_guard.unlock();
+        master_guard.unlock();
+        if (cancel_slave) {
+            slave->cancel();
+        }
         return;
     }
     slaves_.emplace_back(slave);
@@ -54,23 +77,32 @@ void Task::PushInReadyQueue(const std::shared_ptr<Task> &task) const {
     task_owner_pool->ready_tasks_.emplace_back(task);
     task_owner_pool->task_storage_.erase(task);
     task->pushed_in_ready_queue_ = true;
-    task_owner_pool->pool_cv_.notify_one();
+    task_owner_pool->WakeWorker();
 }
 
-void Task::ReleaseDependencies() {
+void Task::ReleaseDependencies(std::vector<std::shared_ptr<Task>>* canceled) {
     std::unique_lock<std::mutex> task_guard(task_mutex_);
     if (slaves_taken_) {
         return;
     }
     std::vector<std::weak_ptr<Task>> slaves = std::move(slaves_);
     slaves_taken_ = true;
+    bool task_canceled = is_canceled_;
+    bool task_failed = is_failed_;
     task_guard.unlock();
 
     for (auto slave : slaves) {
         if (auto slave_task = slave.lock()) {
             std::unique_lock<std::mutex> slave_task_guard(slave_task->task_mutex_);
             --slave_task->dependencies_num_;
-            if (slave_task->is_submitted_ && !slave_task->pushed_in_ready_queue_
+            if (!slave_task->is_canceled_ && !slave_task->process_started_ &&
+                slave_task->CancelsWith(task_canceled, task_failed)) {
+                // Finish() releases its dependents in turn
+                slave_task->is_canceled_ = true;
+                slave_task_guard.unlock();
+                slave_task->ForgetInPool();
+                canceled->push_back(slave_task);
+            } else if (slave_task->is_submitted_ && !slave_task->pushed_in_ready_queue_
                 && slave_task->dependencies_num_ == 0) {
                 slave_task_guard.unlock();
                 PushInReadyQueue(slave_task);
@@ -79,6 +111,18 @@ void Task::ReleaseDependencies() {
     }
 }
 
+void Task::ForgetInPool() {
+    std::unique_lock<std::mutex> task_guard(task_mutex_);
+    auto task_owner_pool = owner_pool_;
+    task_guard.unlock();
+    if (!task_owner_pool) {
+        return;
+    }
+    // nothing is going to push it into the ready queue anymore
+    std::unique_lock<std::mutex> owner_pool_guard(task_owner_pool->pool_mutex_);
+    task_owner_pool->task_storage_.erase(shared_from_this());
+}
+
 void Task::ReleaseTriggers() {
     std::unique_lock<std::mutex> task_guard(task_mutex_);
     if (victims_taken_) {
@@ -101,9 +145,37 @@ void Task::ReleaseTriggers() {
 }
 
 void Task::Finish() {
-    ReleaseDependencies();
+    std::vector<std::shared_ptr<Task>> canceled;
+    ReleaseDependencies(&canceled);
     ReleaseTriggers();
     task_cv_.notify_all();
+
+    // dependents canceled on the way, walked without recursion
+    while (!canceled.empty()) {
+        auto task = std::move(canceled.back());
+        canceled.pop_back();
+        task->ReleaseDependencies(&canceled);
+        task->ReleaseTriggers();
+        task->task_cv_.notify_all();
+    }
+}
+
+void Task::Process() {
+    std::unique_lock<std::mutex> task_guard(task_mutex_);
+    if (is_canceled_) {
+        return;
+    }
+    process_started_ = true;
+    task_guard.unlock();
+
+    try {
+        run();
+        MarkAsCompleted();
+    } catch (const std::exception&) {
+        MarkAsFailed(std::current_exception());
+    }
+
+    Finish();
 }
 
 bool Task::isCompleted() {
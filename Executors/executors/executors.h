@@ -11,6 +11,16 @@
 
 class ThreadPool;
 
+// What a task does when one of its dependencies doesn't complete
+enum class CancelPropagation {
+    // runs anyway and checks its inputs itself
+    None,
+    // gets canceled if a dependency was canceled
+    Canceled,
+    // gets canceled if a dependency was canceled or failed
+    CanceledOrFailed
+};
+
 class Task : public std::enable_shared_from_this<Task> {
 public:
     virtual ~Task() {}
@@ -23,6 +33,11 @@ public:
 
     void setTimeTrigger(std::chrono::system_clock::time_point at);
 
+    // Set it before adding dependencies. Cancellation spreads transitively:
+    // the whole subtree of dependents that haven't started yet is canceled in
+    // one pass, none of their run() is called.
+    void setCancelPropagation(CancelPropagation propagation);
+
 private:
     void AddSlave(std::shared_ptr<Task> slave);
     void PutUnderTrigger(std::shared_ptr<Task> victim);
@@ -31,10 +46,17 @@ private:
 
     void PushInReadyQueue(const std::shared_ptr<Task>& task) const;
 
-    void ReleaseDependencies();
+    void ReleaseDependencies(std::vector<std::shared_ptr<Task>>* canceled);
     void ReleaseTriggers();
     void Finish();
 
+    // must be called with task_mutex_ locked
+    bool CancelsWith(bool dep_canceled, bool dep_failed) const;
+    void ForgetInPool();
+
+    // runs the task unless it was canceled and marks the outcome
+    void Process();
+
 public:
     // Task::run() completed without throwing exception
     bool isCompleted();
@@ -53,11 +75,13 @@ public:
 
 private:
     friend class ThreadPool;
+    friend class BatchingExecutor;
     ThreadPool* owner_pool_ = nullptr;
     std::condition_variable task_cv_;
     std::mutex task_mutex_, process_mutex_;
 
     bool process_started_ = false;
+    CancelPropagation propagation_ = CancelPropagation::None;
 
     bool is_submitted_ = false;
     bool pushed_in_ready_queue_ = false;
@@ -99,6 +123,12 @@ public:
     virtual void startShutdown() = 0;
     virtual void waitShutdown() = 0;
 
+    // Companion executor for tasks that spend their time blocked (file I/O etc.),
+    // nullptr if there is none
+    virtual std::shared_ptr<Executor> blockingExecutor() {
+        return nullptr;
+    }
+
     template <class T>
     FuturePtr<T> invoke(std::function<T()> fn) {
         auto future = std::make_shared<Future<T>>(fn);
@@ -107,8 +137,10 @@ public:
     }
 
     template <class Y, class T>
-    FuturePtr<Y> then(FuturePtr<T> input, std::function<Y()> fn) {
+    FuturePtr<Y> then(FuturePtr<T> input, std::function<Y()> fn,
+                      CancelPropagation propagation = CancelPropagation::None) {
         auto future = std::make_shared<Future<Y>>(fn);
+        future->setCancelPropagation(propagation);
         future->addDependency(input);
         submit(future);
         return future;
@@ -172,6 +204,16 @@ public:
 
 std::shared_ptr<Executor> MakeThreadPoolExecutor(int num_threads);
 
+// Executor for blocking tasks: starts without threads, adds one whenever a task
+// is ready and no thread is idle (up to max_threads), lets idle ones go
+std::shared_ptr<Executor> MakeBlockingExecutor(int max_threads);
+
+// Call it from Task::run() to say that the rest of the task is going to block.
+// The worker thread moves to the pool's blocking executor together with the
+// task and a fresh worker takes its place, so the pool keeps the same number
+// of threads for CPU-bound work. Does nothing outside of ThreadPool workers.
+void MarkAsBlocking();
+
 template <class T>
 class Future : public Task {
 public:
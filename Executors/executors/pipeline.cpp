@@ -0,0 +1,289 @@
+#include "pipeline.h"
+#include <cassert>
+#include <stdexcept>
+
+struct PipelineToken {
+    size_t seq;
+    std::any value;
+};
+
+struct PipelineStage {
+    Pipeline::Mode mode = Pipeline::Mode::Parallel;
+    std::function<std::any(std::any)> fn;
+
+    // only for serial stages
+    bool busy = false;
+    size_t next_seq = 0;
+    std::map<size_t, std::any> pending;
+};
+
+// calls on_refused if the executor drops the task without running it,
+// e.g. because it is shut down
+class SpawnGuard {
+public:
+    explicit SpawnGuard(std::function<void()> on_refused) : on_refused_(std::move(on_refused)) {
+    }
+
+    ~SpawnGuard() {
+        if (!ran_) {
+            on_refused_();
+        }
+    }
+
+    void MarkAsRan() {
+        ran_ = true;
+    }
+
+private:
+    std::function<void()> on_refused_;
+    bool ran_ = false;
+};
+
+struct PipelineState : public std::enable_shared_from_this<PipelineState> {
+    std::shared_ptr<Executor> executor;
+    int max_tokens;
+    std::function<std::optional<std::any>()> source;
+    std::vector<PipelineStage> stages;
+    FuturePtr<Unit> done;
+
+    std::mutex state_mutex;
+    bool started = false;
+    bool source_busy = false;
+    bool source_done = false;
+    bool stopped = false;
+    bool finished = false;
+    size_t next_seq = 0;
+    int in_flight = 0;
+    // shared with the done future, which may outlive the state
+    std::shared_ptr<std::exception_ptr> error = std::make_shared<std::exception_ptr>();
+
+    // must be called with state_mutex unlocked, taken_stage is the serial
+    // stage the spawned task holds along with its token, if any
+    void Spawn(std::function<void()> fn, PipelineStage* taken_stage);
+    void SpawnRefused(PipelineStage* taken_stage);
+    void Pull();
+    std::optional<PipelineToken> NextToken();
+    // returns true if the item went through all stages and its token is free
+    bool Drive(PipelineToken token, size_t stage_ind, bool stage_taken);
+
+    // next ones must be called with state_mutex locked
+    bool CanTakeNext(const PipelineStage& stage) const;
+    PipelineToken TakeNext(PipelineStage* stage);
+    void Fail(std::exception_ptr error_ptr);
+    void ReleaseToken();
+    void CheckFinished();
+};
+
+void PipelineState::Spawn(std::function<void()> fn, PipelineStage* taken_stage) {
+    auto self = shared_from_this();
+    auto guard = std::make_shared<SpawnGuard>([self, taken_stage]() {
+        self->SpawnRefused(taken_stage);
+    });
+    executor->invoke<Unit>([fn, guard, self]() {
+        guard->MarkAsRan();
+        fn();
+        return Unit{};
+    });
+}
+
+void PipelineState::SpawnRefused(PipelineStage* taken_stage) {
+    std::unique_lock<std::mutex> guard(state_mutex);
+    Fail(std::make_exception_ptr(std::runtime_error("Pipeline task refused by the executor")));
+    if (taken_stage) {
+        taken_stage->busy = false;
+        ReleaseToken();
+    }
+    CheckFinished();
+}
+
+bool PipelineState::CanTakeNext(const PipelineStage& stage) const {
+    if (stopped || stage.busy || stage.pending.empty()) {
+        return false;
+    }
+    return stage.mode == Pipeline::Mode::SerialOutOfOrder ||
+           stage.pending.begin()->first == stage.next_seq;
+}
+
+PipelineToken PipelineState::TakeNext(PipelineStage* stage) {
+    auto first = stage->pending.begin();
+    PipelineToken token{first->first, std::move(first->second)};
+    stage->pending.erase(first);
+    stage->busy = true;
+    return token;
+}
+
+void PipelineState::Fail(std::exception_ptr error_ptr) {
+    if (!*error) {
+        *error = error_ptr;
+    }
+    stopped = true;
+    // items parked in serial stages will never move on
+    for (auto& stage : stages) {
+        in_flight -= stage.pending.size();
+        stage.pending.clear();
+    }
+}
+
+void PipelineState::ReleaseToken() {
+    --in_flight;
+    assert(in_flight >= 0);
+}
+
+void PipelineState::CheckFinished() {
+    if (finished || source_busy || in_flight != 0 || !(source_done || stopped)) {
+        return;
+    }
+    finished = true;
+    executor->submit(done);
+}
+
+void PipelineState::Pull() {
+    // a finished item frees its token for the next one, looping here rather
+    // than pulling from the end of Drive keeps the stack flat
+    while (auto token = NextToken()) {
+        if (!Drive(std::move(*token), 0, false)) {
+            return;
+        }
+    }
+}
+
+std::optional<PipelineToken> PipelineState::NextToken() {
+    std::unique_lock<std::mutex> guard(state_mutex);
+    if (source_busy || source_done || stopped || in_flight >= max_tokens) {
+        CheckFinished();
+        return std::nullopt;
+    }
+    source_busy = true;
+    guard.unlock();
+
+    std::optional<std::any> value;
+    std::exception_ptr source_error;
+    try {
+        value = source();
+    } catch (const std::exception&) {
+        source_error = std::current_exception();
+    }
+
+    guard.lock();
+    source_busy = false;
+    if (source_error) {
+        Fail(source_error);
+    }
+    if (!value || stopped) {
+        source_done = true;
+        CheckFinished();
+        return std::nullopt;
+    }
+    PipelineToken token{next_seq++, std::move(*value)};
+    ++in_flight;
+    bool has_free_tokens = in_flight < max_tokens;
+    guard.unlock();
+
+    if (has_free_tokens) {
+        Spawn([this]() { Pull(); }, nullptr);
+    }
+    return token;
+}
+
+bool PipelineState::Drive(PipelineToken token, size_t stage_ind, bool stage_taken) {
+    std::unique_lock<std::mutex> guard(state_mutex, std::defer_lock);
+    while (stage_ind < stages.size()) {
+        auto& stage = stages[stage_ind];
+        bool serial = stage.mode != Pipeline::Mode::Parallel;
+
+        guard.lock();
+        if (stopped) {
+            if (stage_taken) {
+                stage.busy = false;
+            }
+            ReleaseToken();
+            CheckFinished();
+            return false;
+        }
+        if (serial && !stage_taken) {
+            stage.pending.emplace(token.seq, std::move(token.value));
+            if (!CanTakeNext(stage)) {
+                // whoever holds the stage will pick it up
+                return false;
+            }
+            token = TakeNext(&stage);
+        }
+        guard.unlock();
+
+        try {
+            token.value = stage.fn(std::move(token.value));
+        } catch (const std::exception&) {
+            guard.lock();
+            if (serial) {
+                stage.busy = false;
+            }
+            Fail(std::current_exception());
+            ReleaseToken();
+            CheckFinished();
+            return false;
+        }
+
+        if (serial) {
+            guard.lock();
+            stage.busy = false;
+            ++stage.next_seq;
+            if (CanTakeNext(stage)) {
+                auto next = std::make_shared<PipelineToken>(TakeNext(&stage));
+                guard.unlock();
+                Spawn(
+                    [this, next, stage_ind]() {
+                        if (Drive(std::move(*next), stage_ind, true)) {
+                            Pull();
+                        }
+                    },
+                    &stage);
+            } else {
+                guard.unlock();
+            }
+        }
+        ++stage_ind;
+        stage_taken = false;
+    }
+
+    guard.lock();
+    ReleaseToken();
+    return true;
+}
+
+Pipeline::Pipeline(std::shared_ptr<Executor> executor, int max_tokens)
+    : state_(std::make_shared<PipelineState>()) {
+    state_->executor = std::move(executor);
+    state_->max_tokens = std::max(max_tokens, 1);
+    auto error = state_->error;
+    state_->done = std::make_shared<Future<Unit>>([error]() {
+        if (*error) {
+            std::rethrow_exception(*error);
+        }
+        return Unit{};
+    });
+}
+
+void Pipeline::SetSource(std::function<std::optional<std::any>()> source) {
+    state_->source = std::move(source);
+}
+
+void Pipeline::AddStage(Mode mode, std::function<std::any(std::any)> fn) {
+    PipelineStage stage;
+    stage.mode = mode;
+    stage.fn = std::move(fn);
+    state_->stages.push_back(std::move(stage));
+}
+
+FuturePtr<Unit> Pipeline::run() {
+    std::unique_lock<std::mutex> guard(state_->state_mutex);
+    if (state_->started) {
+        return state_->done;
+    }
+    state_->started = true;
+    if (!state_->source) {
+        state_->source_done = true;
+    }
+    guard.unlock();
+    state_->Spawn([state = state_.get()]() { state->Pull(); }, nullptr);
+    return state_->done;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <any>
+#include <map>
+#include <optional>
+#include "executors.h"
+
+struct PipelineState;
+
+// Streaming pipeline on top of an Executor. A serial source produces items,
+// each of them passes all stages in order. At most max_tokens items are in
+// flight at once, so the source is throttled when later stages lag behind.
+// Items are carried from stage to stage by the same task where possible,
+// not by a separate Future per item and stage.
+//
+//   Pipeline pipeline(pool, 16);
+//   pipeline.setSource<int>([&]() -> std::optional<int> { ... });
+//   pipeline.addStage<int, int>(Pipeline::Mode::Parallel, [](int x) { return x * x; });
+//   pipeline.addSink<int>(Pipeline::Mode::SerialInOrder, [&](int x) { sum += x; });
+//   pipeline.run()->get();
+class Pipeline {
+public:
+    enum class Mode {
+        // one item at a time, in the order the source produced them
+        SerialInOrder,
+        // one item at a time, in any order
+        SerialOutOfOrder,
+        // any number of items at once
+        Parallel
+    };
+
+    Pipeline(std::shared_ptr<Executor> executor, int max_tokens);
+
+    // source is called serially until it returns std::nullopt
+    template <class T>
+    void setSource(std::function<std::optional<T>()> source) {
+        SetSource([source]() -> std::optional<std::any> {
+            auto value = source();
+            if (!value) {
+                return std::nullopt;
+            }
+            return std::any(std::move(*value));
+        });
+    }
+
+    template <class In, class Out>
+    void addStage(Mode mode, std::function<Out(In)> fn) {
+        AddStage(mode, [fn](std::any value) {
+            return std::any(fn(std::any_cast<In>(std::move(value))));
+        });
+    }
+
+    template <class In>
+    void addSink(Mode mode, std::function<void(In)> fn) {
+        AddStage(mode, [fn](std::any value) {
+            fn(std::any_cast<In>(std::move(value)));
+            return std::any();
+        });
+    }
+
+    // starts the pipeline, the future completes when every item has passed
+    // the last stage, or fails with the first exception thrown by a stage.
+    // If the executor refuses a task, e.g. because it is shut down, the
+    // pipeline stops and the future finishes as the executor leaves it,
+    // canceled in the case of a shut down ThreadPool
+    FuturePtr<Unit> run();
+
+private:
+    void SetSource(std::function<std::optional<std::any>()> source);
+    void AddStage(Mode mode, std::function<std::any(std::any)> fn);
+
+    std::shared_ptr<PipelineState> state_;
+};
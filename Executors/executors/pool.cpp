@@ -3,12 +3,26 @@
 #include <cassert>
 #include <iostream>
 
+namespace {
+// pool whose worker is the current thread
+thread_local ThreadPool* current_pool = nullptr;
+}  // namespace
+
 std::shared_ptr<Task> ThreadPool::GetTaskFromReadyQueue() {
     std::unique_lock<std::mutex> pool_guard(pool_mutex_);
+    ++idle_workers_;
     while (turned_on_ && ready_tasks_.empty()) {
-        pool_cv_.wait(pool_guard);
+        if (!growable_) {
+            pool_cv_.wait(pool_guard);
+        } else if (pool_cv_.wait_for(pool_guard, keep_alive_) == std::cv_status::timeout) {
+            break;
+        }
     }
-    if (!turned_on_ && ready_tasks_.empty()) {
+    --idle_workers_;
+    if (ready_tasks_.empty()) {
+        // retire under the same lock that saw the timeout, otherwise submit
+        // could count this worker as alive and notify nobody
+        RetireWorker();
         return nullptr;
     }
 
@@ -17,23 +31,6 @@ std::shared_ptr<Task> ThreadPool::GetTaskFromReadyQueue() {
     return cur_task;
 }
 
-void ThreadPool::ProcessTask(std::shared_ptr<Task> task) const {
-    std::unique_lock<std::mutex> task_guard(task->task_mutex_);
-    if (task->is_canceled_) {
-        return;
-    }
-    task_guard.unlock();
-
-    try {
-        task->run();
-        task->MarkAsCompleted();
-    } catch (const std::exception&) {
-        task->MarkAsFailed(std::current_exception());
-    }
-
-    task->Finish();
-}
-
 std::optional<std::shared_ptr<Task>> ThreadPool::GetTaskFromTimeHeap() {
     std::unique_lock<std::mutex> pool_guard(pool_mutex_);
     std::chrono::system_clock::time_point deadline;
@@ -62,25 +59,27 @@ void ThreadPool::PushFromTimeHeap(std::shared_ptr<Task> task) {
         ready_tasks_.emplace_back(task);
         task_storage_.erase(task);
         task->pushed_in_ready_queue_ = true;
-        pool_cv_.notify_one();
+        WakeWorker();
     }
 }
 
-ThreadPool::ThreadPool(int threads_num) {
+ThreadPool::ThreadPool(int threads_num) : max_workers_(threads_num) {
+    std::unique_lock<std::mutex> pool_guard(pool_mutex_);
     for (int ind = 0; ind < threads_num; ++ind) {
-        workers_.emplace_back([this]() {
-            while (true) {
-                auto cur_task = GetTaskFromReadyQueue();
-                if (!cur_task) {
-                    return;
-                }
-                ProcessTask(cur_task);
-            }
-        });
+        SpawnWorker();
     }
+    pool_guard.unlock();
+    StartTimeHeapWorker();
+}
+
+ThreadPool::ThreadPool(int max_threads, std::chrono::milliseconds keep_alive)
+    : growable_(true), max_workers_(max_threads), keep_alive_(keep_alive) {
+    StartTimeHeapWorker();
+}
 
-    // now create thread to manage the time_heap
-    workers_.emplace_back([this]() {
+void ThreadPool::StartTimeHeapWorker() {
+    // thread to manage the time_heap
+    time_heap_worker_ = std::thread([this]() {
         while (true) {
             auto task_opt = GetTaskFromTimeHeap();
             if (!task_opt) {
@@ -95,6 +94,104 @@ ThreadPool::ThreadPool(int threads_num) {
     });
 }
 
+void ThreadPool::RunWorker() {
+    current_pool = this;
+    while (true) {
+        auto cur_task = GetTaskFromReadyQueue();
+        if (!cur_task) {
+            break;
+        }
+        cur_task->Process();
+        if (current_pool != this) {
+            // the task called MarkAsBlocking(), so now we serve the blocking pool
+            current_pool->RunWorker();
+            return;
+        }
+    }
+}
+
+void ThreadPool::WakeWorker() {
+    if (growable_ && static_cast<int>(ready_tasks_.size()) > idle_workers_
+        && workers_num_ < max_workers_) {
+        SpawnWorker();
+    } else {
+        pool_cv_.notify_one();
+    }
+}
+
+void ThreadPool::SpawnWorker() {
+    // retired threads have already left RunWorker, so joining is quick
+    for (auto& worker : retired_workers_) {
+        worker.join();
+    }
+    retired_workers_.clear();
+    ++workers_num_;
+    workers_.emplace_back([this]() { RunWorker(); });
+}
+
+std::thread ThreadPool::TakeOwnThread() {
+    auto self_id = std::this_thread::get_id();
+    for (auto it = workers_.begin(); it != workers_.end(); ++it) {
+        if (it->get_id() == self_id) {
+            std::thread self = std::move(*it);
+            workers_.erase(it);
+            return self;
+        }
+    }
+    // waitShutdown has already taken it and is joining us
+    return std::thread();
+}
+
+void ThreadPool::RetireWorker() {
+    --workers_num_;
+    auto self = TakeOwnThread();
+    if (self.joinable()) {
+        retired_workers_.push_back(std::move(self));
+    }
+}
+
+ThreadPool* ThreadPool::GetBlockingPool() {
+    std::unique_lock<std::mutex> pool_guard(pool_mutex_);
+    if (!blocking_pool_) {
+        blocking_pool_ = std::make_shared<ThreadPool>(kMaxBlockingThreads, kBlockingKeepAlive);
+        if (!turned_on_) {
+            blocking_pool_->startShutdown();
+        }
+    }
+    return blocking_pool_.get();
+}
+
+std::shared_ptr<Executor> ThreadPool::blockingExecutor() {
+    if (growable_) {
+        return nullptr;
+    }
+    GetBlockingPool();
+    std::unique_lock<std::mutex> pool_guard(pool_mutex_);
+    return blocking_pool_;
+}
+
+void MarkAsBlocking() {
+    ThreadPool* pool = current_pool;
+    if (!pool || pool->growable_) {
+        return;
+    }
+    ThreadPool* blocking_pool = pool->GetBlockingPool();
+
+    std::unique_lock<std::mutex> pool_guard(pool->pool_mutex_);
+    auto self = pool->TakeOwnThread();
+    --pool->workers_num_;
+    pool->SpawnWorker();
+    pool_guard.unlock();
+
+    // may go over max_workers_ of the blocking pool, the task is already running
+    std::unique_lock<std::mutex> blocking_guard(blocking_pool->pool_mutex_);
+    ++blocking_pool->workers_num_;
+    if (self.joinable()) {
+        blocking_pool->workers_.push_back(std::move(self));
+    }
+    current_pool = blocking_pool;
+}
+
 ThreadPool::~ThreadPool() {
     startShutdown();
     waitShutdown();
@@ -125,7 +222,7 @@ void ThreadPool::submit(std::shared_ptr<Task> task) {
         || (task->has_dependencies_ && task->dependencies_num_ == 0)) {
         ready_tasks_.emplace_back(task);
         task->pushed_in_ready_queue_ = true;
-        pool_cv_.notify_one();
+        WakeWorker();
     } else {
         if (task->has_deadline_) {
             time_heap_.emplace(task, task->deadline_);
@@ -142,17 +239,55 @@ void ThreadPool::startShutdown() {
     turned_on_ = false;
     pool_cv_.notify_all();
     time_heap_cv_.notify_all();
+    auto blocking_pool = blocking_pool_;
+    guard.unlock();
+    if (blocking_pool) {
+        blocking_pool->startShutdown();
+    }
 }
 
 void ThreadPool::waitShutdown() {
     std::unique_lock<std::mutex> guard(shutdown_mutex_);
-    for (auto& worker : workers_) {
-        if (worker.joinable()) {
-            worker.join();
+    // workers may still spawn replacements while we join, so repeat until none left
+    while (true) {
+        std::unique_lock<std::mutex> pool_guard(pool_mutex_);
+        std::vector<std::thread> workers;
+        for (auto& worker : workers_) {
+            workers.push_back(std::move(worker));
+        }
+        workers_.clear();
+        for (auto& worker : retired_workers_) {
+            workers.push_back(std::move(worker));
         }
+        retired_workers_.clear();
+        pool_guard.unlock();
+
+        if (workers.empty()) {
+            break;
+        }
+        for (auto& worker : workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+    if (time_heap_worker_.joinable()) {
+        time_heap_worker_.join();
+    }
+
+    std::unique_lock<std::mutex> pool_guard(pool_mutex_);
+    auto blocking_pool = blocking_pool_;
+    pool_guard.unlock();
+    if (blocking_pool) {
+        blocking_pool->waitShutdown();
     }
 }
 
 std::shared_ptr<Executor> MakeThreadPoolExecutor(int num_threads) {
     return std::make_shared<ThreadPool>(num_threads);
 }
+
+
+std::shared_ptr<Executor> MakeBlockingExecutor(int max_threads) {
+    return std::make_shared<ThreadPool>(max_threads, ThreadPool::kBlockingKeepAlive);
+}
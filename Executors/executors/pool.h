@@ -1,5 +1,6 @@
 #pragma once
 #include <deque>
+#include <list>
 #include <queue>
 #include <optional>
 #include "executors.h"
@@ -21,6 +22,9 @@ struct TimedTask {
 class ThreadPool : public Executor {
 public:
     explicit ThreadPool(int threads_num);
+    // growable pool: no threads at start, a new one is added when a ready task
+    // finds no idle worker, a worker idle for keep_alive goes away
+    ThreadPool(int max_threads, std::chrono::milliseconds keep_alive);
     ~ThreadPool() override;
 
     void submit(std::shared_ptr<Task> task) override;
@@ -28,19 +32,44 @@ public:
     void startShutdown() override;
     void waitShutdown() override;
 
+    std::shared_ptr<Executor> blockingExecutor() override;
+
+    static constexpr int kMaxBlockingThreads = 512;
+    static constexpr std::chrono::seconds kBlockingKeepAlive{10};
+
 private:
+    // nullptr means the worker is retired already and must leave
     std::shared_ptr<Task> GetTaskFromReadyQueue();
-    void ProcessTask(std::shared_ptr<Task> task) const;
     std::optional<std::shared_ptr<Task>> GetTaskFromTimeHeap();
     void PushFromTimeHeap(std::shared_ptr<Task> task);
 
+    void StartTimeHeapWorker();
+    void RunWorker();
+    ThreadPool* GetBlockingPool();
+
+    // next ones must be called with pool_mutex_ locked
+    void WakeWorker();
+    void SpawnWorker();
+    void RetireWorker();
+    std::thread TakeOwnThread();
+
     friend class Task;
-    std::vector<std::thread> workers_;
+    friend void MarkAsBlocking();
+    std::list<std::thread> workers_;
+    std::vector<std::thread> retired_workers_;
+    std::thread time_heap_worker_;
     std::mutex pool_mutex_, shutdown_mutex_;
     std::condition_variable pool_cv_, time_heap_cv_;
     std::set<std::shared_ptr<Task>> task_storage_;
     std::deque<std::shared_ptr<Task>> ready_tasks_;
     std::priority_queue<TimedTask> time_heap_;
 
+    bool growable_ = false;
+    int max_workers_ = 0;
+    std::chrono::milliseconds keep_alive_{0};
+    int workers_num_ = 0;
+    int idle_workers_ = 0;
+    std::shared_ptr<ThreadPool> blocking_pool_;
+
     bool turned_on_ = true;
 };
@@ -0,0 +1,221 @@
+#include "reactor.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <system_error>
+
+namespace {
+void ThrowSystemError(const char* what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+}  // namespace
+
+Reactor::Reactor(std::shared_ptr<Executor> executor) : executor_(std::move(executor)) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0) {
+        ThrowSystemError("epoll_create1");
+    }
+    wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd_ < 0) {
+        close(epoll_fd_);
+        ThrowSystemError("eventfd");
+    }
+    epoll_event wake_event{};
+    wake_event.events = EPOLLIN;
+    wake_event.data.fd = wake_fd_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &wake_event) < 0) {
+        close(wake_fd_);
+        close(epoll_fd_);
+        ThrowSystemError("epoll_ctl");
+    }
+    loop_thread_ = std::thread([this]() { Loop(); });
+}
+
+Reactor::~Reactor() {
+    shutdown();
+    close(wake_fd_);
+    close(epoll_fd_);
+}
+
+void Reactor::UpdateInterest(int fd, const Waiters& waiters, bool registered) {
+    epoll_event event{};
+    event.data.fd = fd;
+    if (!waiters.readers.empty()) {
+        event.events |= EPOLLIN;
+    }
+    if (!waiters.writers.empty()) {
+        event.events |= EPOLLOUT;
+    }
+    int op = registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (event.events == 0) {
+        op = EPOLL_CTL_DEL;
+    }
+    if (epoll_ctl(epoll_fd_, op, fd, &event) < 0) {
+        ThrowSystemError("epoll_ctl");
+    }
+}
+
+void Reactor::submit(int fd, Event event, std::shared_ptr<Task> task) {
+    if (!task) {
+        return;
+    }
+    std::unique_lock<std::mutex> guard(reactor_mutex_);
+    if (!turned_on_) {
+        guard.unlock();
+        task->cancel();
+        return;
+    }
+
+    auto found = waiters_.find(fd);
+    bool registered = found != waiters_.end();
+    Waiters waiters = registered ? found->second : Waiters();
+    auto& list = (event == Event::Readable) ? waiters.readers : waiters.writers;
+    list.push_back(task);
+    try {
+        UpdateInterest(fd, waiters, registered);
+    } catch (const std::system_error& error) {
+        if (error.code().value() != EPERM) {
+            throw;
+        }
+        // regular file, it never blocks in the epoll sense
+        guard.unlock();
+        auto blocking = executor_->blockingExecutor();
+        (blocking ? blocking : executor_)->submit(std::move(task));
+        return;
+    }
+    waiters_[fd] = std::move(waiters);
+}
+
+void Reactor::Loop() {
+    const int kMaxEvents = 64;
+    epoll_event events[kMaxEvents];
+    while (true) {
+        int ready = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            SubmitAllWaiters();
+            return;
+        }
+
+        std::vector<std::shared_ptr<Task>> ready_tasks;
+        std::unique_lock<std::mutex> guard(reactor_mutex_);
+        if (!turned_on_) {
+            return;
+        }
+        for (int ind = 0; ind < ready; ++ind) {
+            int fd = events[ind].data.fd;
+            auto found = waiters_.find(fd);
+            if (fd == wake_fd_ || found == waiters_.end()) {
+                continue;
+            }
+            auto& waiters = found->second;
+            // on errors and hangups wake everybody, they will see it themselves
+            uint32_t happened = events[ind].events;
+            bool failed = happened & (EPOLLERR | EPOLLHUP);
+            if ((happened & EPOLLIN) || failed) {
+                for (auto& task : waiters.readers) {
+                    ready_tasks.push_back(std::move(task));
+                }
+                waiters.readers.clear();
+            }
+            if ((happened & EPOLLOUT) || failed) {
+                for (auto& task : waiters.writers) {
+                    ready_tasks.push_back(std::move(task));
+                }
+                waiters.writers.clear();
+            }
+            try {
+                UpdateInterest(fd, waiters, true);
+            } catch (const std::system_error&) {
+                // fd was closed under us, the rest won't get an event either
+                for (auto& task : waiters.readers) {
+                    ready_tasks.push_back(std::move(task));
+                }
+                for (auto& task : waiters.writers) {
+                    ready_tasks.push_back(std::move(task));
+                }
+                waiters.readers.clear();
+                waiters.writers.clear();
+            }
+            if (waiters.readers.empty() && waiters.writers.empty()) {
+                waiters_.erase(found);
+            }
+        }
+        guard.unlock();
+
+        for (auto& task : ready_tasks) {
+            executor_->submit(task);
+        }
+    }
+}
+
+void Reactor::SubmitAllWaiters() {
+    std::unique_lock<std::mutex> guard(reactor_mutex_);
+    turned_on_ = false;
+    auto waiters = std::move(waiters_);
+    waiters_.clear();
+    guard.unlock();
+
+    for (auto& [fd, fd_waiters] : waiters) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        for (auto& task : fd_waiters.readers) {
+            executor_->submit(task);
+        }
+        for (auto& task : fd_waiters.writers) {
+            executor_->submit(task);
+        }
+    }
+}
+
+FuturePtr<std::string> Reactor::read(int fd, size_t max_len) {
+    return invokeWhen<std::string>(fd, Event::Readable, [fd, max_len]() {
+        std::string buffer(max_len, '\0');
+        ssize_t got = ::read(fd, &buffer[0], max_len);
+        if (got < 0) {
+            ThrowSystemError("read");
+        }
+        buffer.resize(got);
+        return buffer;
+    });
+}
+
+FuturePtr<size_t> Reactor::write(int fd, std::string data) {
+    return invokeWhen<size_t>(fd, Event::Writable, [fd, data]() {
+        ssize_t written = ::write(fd, data.data(), data.size());
+        if (written < 0) {
+            ThrowSystemError("write");
+        }
+        return static_cast<size_t>(written);
+    });
+}
+
+void Reactor::shutdown() {
+    // the loop may have stopped on its own already, it still has to be joined
+    std::unique_lock<std::mutex> guard(reactor_mutex_);
+    turned_on_ = false;
+    auto waiters = std::move(waiters_);
+    waiters_.clear();
+    guard.unlock();
+
+    uint64_t one = 1;
+    ssize_t written = ::write(wake_fd_, &one, sizeof(one));
+    (void)written;
+    std::unique_lock<std::mutex> shutdown_guard(shutdown_mutex_);
+    if (loop_thread_.joinable()) {
+        loop_thread_.join();
+    }
+    shutdown_guard.unlock();
+
+    for (auto& [fd, fd_waiters] : waiters) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        for (auto& task : fd_waiters.readers) {
+            task->cancel();
+        }
+        for (auto& task : fd_waiters.writers) {
+            task->cancel();
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+#include <unordered_map>
+#include "executors.h"
+
+// Waits on file descriptors (pipes, sockets, eventfds...) with epoll in a single
+// thread and hands tasks to the executor once their fd is ready, so nobody has
+// to block a worker on it. Futures made by the reactor are usual Tasks, so then()
+// chains on them run on the executor as well.
+class Reactor {
+public:
+    enum class Event {
+        Readable,
+        Writable
+    };
+
+    explicit Reactor(std::shared_ptr<Executor> executor);
+    ~Reactor();
+
+    // task is submitted to the executor when fd becomes ready for event.
+    // epoll can't wait on regular files, they are always ready, so such tasks
+    // go straight to the blocking executor (or to the executor if there is none)
+    void submit(int fd, Event event, std::shared_ptr<Task> task);
+
+    template <class T>
+    FuturePtr<T> invokeWhen(int fd, Event event, std::function<T()> fn) {
+        auto future = std::make_shared<Future<T>>(fn);
+        submit(fd, event, future);
+        return future;
+    }
+
+    // one read() call of at most max_len bytes, empty string means EOF
+    FuturePtr<std::string> read(int fd, size_t max_len);
+    // one write() call, returns the number of bytes written
+    FuturePtr<size_t> write(int fd, std::string data);
+
+    // stops the loop, tasks still waiting for their fd are canceled.
+    // If epoll itself fails the loop stops on its own, submits every waiting
+    // task so it sees the state of its fd, and cancels later submits
+    void shutdown();
+
+private:
+    struct Waiters {
+        std::vector<std::shared_ptr<Task>> readers, writers;
+    };
+
+    void Loop();
+    void SubmitAllWaiters();
+    void UpdateInterest(int fd, const Waiters& waiters, bool registered);
+
+    std::shared_ptr<Executor> executor_;
+    int epoll_fd_ = -1;
+    int wake_fd_ = -1;
+    std::mutex reactor_mutex_, shutdown_mutex_;
+    std::unordered_map<int, Waiters> waiters_;
+    bool turned_on_ = true;
+    std::thread loop_thread_;
+};
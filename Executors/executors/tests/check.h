@@ -0,0 +1,63 @@
+#pragma once
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Just enough for the tests to need no framework: CHECK throws on failure,
+// RunTests runs them all and gives the exit code.
+
+#define CHECK_STRINGIFY(x) #x
+#define CHECK_LINE(line) CHECK_STRINGIFY(line)
+#define CHECK(cond)                                                                       \
+    do {                                                                                  \
+        if (!(cond)) {                                                                    \
+            throw std::runtime_error(__FILE__ ":" CHECK_LINE(__LINE__) ": CHECK(" #cond \
+                                                                         ") failed");     \
+        }                                                                                 \
+    } while (false)
+
+template <class Exception, class Fn>
+bool Throws(Fn fn) {
+    try {
+        fn();
+    } catch (const Exception&) {
+        return true;
+    }
+    return false;
+}
+
+// polls until pred() holds, false if it still doesn't after timeout
+template <class Pred>
+bool Eventually(Pred pred, std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!pred()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    return true;
+}
+
+using TestList = std::vector<std::pair<const char*, std::function<void()>>>;
+
+inline int RunTests(const TestList& tests) {
+    int failed = 0;
+    for (const auto& [ name, test ] : tests) {
+        try {
+            test();
+            std::cout << "[ OK ] " << name << std::endl;
+        } catch (const std::exception& error) {
+            std::cout << "[FAIL] " << name << ": " << error.what() << std::endl;
+            ++failed;
+        }
+    }
+    std::cout << tests.size() - failed << " of " << tests.size() << " passed" << std::endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,112 @@
+#include <atomic>
+#include "batching.h"
+#include "check.h"
+
+namespace {
+// long max_delay makes batches go only when full or flushed
+std::shared_ptr<BatchingExecutor> MakeBatching(const std::shared_ptr<Executor>& pool,
+                                               size_t max_batch_size,
+                                               std::chrono::milliseconds max_delay) {
+    return std::make_shared<BatchingExecutor>(pool, max_batch_size, max_delay);
+}
+
+void Shutdown(const std::shared_ptr<Executor>& batching, const std::shared_ptr<Executor>& pool) {
+    batching->startShutdown();
+    batching->waitShutdown();
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+}  // namespace
+
+void TestErrorFailsOnlyItsTask() {
+    auto pool = MakeThreadPoolExecutor(2);
+    auto batching = MakeBatching(pool, 8, std::chrono::seconds(10));
+    std::vector<FuturePtr<int>> futures;
+    for (int ind = 0; ind < 8; ++ind) {
+        futures.push_back(batching->invoke<int>([ind]() {
+            if (ind == 3) {
+                throw std::runtime_error("task");
+            }
+            return ind;
+        }));
+    }
+    for (int ind = 0; ind < 8; ++ind) {
+        if (ind == 3) {
+            CHECK(Throws<std::runtime_error>([&]() { futures[ind]->get(); }));
+            CHECK(futures[ind]->isFailed());
+        } else {
+            CHECK(futures[ind]->get() == ind);
+        }
+    }
+    Shutdown(batching, pool);
+}
+
+void TestCancelQueuedTask() {
+    auto pool = MakeThreadPoolExecutor(2);
+    auto batching = MakeBatching(pool, 100, std::chrono::seconds(10));
+    std::atomic<bool> ran{false};
+    auto canceled = batching->invoke<Unit>([&]() {
+        ran = true;
+        return Unit{};
+    });
+    auto other = batching->invoke<int>([]() { return 1; });
+    canceled->cancel();
+    batching->flush();
+
+    CHECK(other->get() == 1);
+    CHECK(canceled->isCanceled());
+    CHECK(!ran);
+    Shutdown(batching, pool);
+}
+
+void TestFlushBySize() {
+    auto pool = MakeThreadPoolExecutor(2);
+    auto batching = MakeBatching(pool, 4, std::chrono::seconds(10));
+    std::vector<FuturePtr<int>> futures;
+    for (int ind = 0; ind < 3; ++ind) {
+        futures.push_back(batching->invoke<int>([ind]() { return ind; }));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (auto& future : futures) {
+        CHECK(!future->isFinished());
+    }
+    // the fourth one fills the batch
+    futures.push_back(batching->invoke<int>([]() { return 3; }));
+    for (int ind = 0; ind < 4; ++ind) {
+        CHECK(Eventually([&]() { return futures[ind]->isFinished(); }));
+        CHECK(futures[ind]->get() == ind);
+    }
+    Shutdown(batching, pool);
+}
+
+void TestFlushByDelay() {
+    auto pool = MakeThreadPoolExecutor(2);
+    auto batching = MakeBatching(pool, 1000, std::chrono::milliseconds(20));
+    auto start = std::chrono::steady_clock::now();
+    auto future = batching->invoke<int>([]() { return 7; });
+    CHECK(Eventually([&]() { return future->isFinished(); }));
+    CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+    CHECK(future->get() == 7);
+    Shutdown(batching, pool);
+}
+
+void TestDependenciesBypassBatching() {
+    auto pool = MakeThreadPoolExecutor(2);
+    auto batching = MakeBatching(pool, 1000, std::chrono::seconds(10));
+    auto first = pool->invoke<int>([]() { return 1; });
+    auto second = std::make_shared<Future<int>>([first]() { return first->get() + 1; });
+    second->addDependency(first);
+    batching->submit(second);
+    // the batch is neither full nor due, only the bypass can run it
+    CHECK(Eventually([&]() { return second->isFinished(); }));
+    CHECK(second->get() == 2);
+    Shutdown(batching, pool);
+}
+
+int main() {
+    return RunTests({{"Batching.ErrorFailsOnlyItsTask", TestErrorFailsOnlyItsTask},
+                     {"Batching.CancelQueuedTask", TestCancelQueuedTask},
+                     {"Batching.FlushBySize", TestFlushBySize},
+                     {"Batching.FlushByDelay", TestFlushByDelay},
+                     {"Batching.DependenciesBypassBatching", TestDependenciesBypassBatching}});
+}
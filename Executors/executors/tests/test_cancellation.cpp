@@ -0,0 +1,165 @@
+#include <atomic>
+#include "check.h"
+#include "executors.h"
+
+namespace {
+class CountingTask : public Task {
+public:
+    explicit CountingTask(std::function<void()> fn = {}) : fn_(std::move(fn)) {}
+
+    void run() override {
+        ++runs;
+        if (fn_) {
+            fn_();
+        }
+    }
+
+    std::atomic<int> runs{0};
+
+private:
+    std::function<void()> fn_;
+};
+
+struct Chain {
+    std::shared_ptr<CountingTask> a, b, c;
+};
+
+// b depends on a and c on b, b and c are submitted and wait for a
+Chain MakeChain(const std::shared_ptr<Executor>& pool, CancelPropagation propagation,
+                std::function<void()> a_fn = {}) {
+    Chain chain{std::make_shared<CountingTask>(std::move(a_fn)),
+                std::make_shared<CountingTask>(), std::make_shared<CountingTask>()};
+    chain.b->setCancelPropagation(propagation);
+    chain.c->setCancelPropagation(propagation);
+    chain.b->addDependency(chain.a);
+    chain.c->addDependency(chain.b);
+    pool->submit(chain.b);
+    pool->submit(chain.c);
+    return chain;
+}
+
+void Shutdown(const std::shared_ptr<Executor>& pool) {
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+}  // namespace
+
+void TestCancelSpreadsDownTheChain() {
+    auto pool = MakeThreadPoolExecutor(2);
+    for (auto propagation : {CancelPropagation::Canceled, CancelPropagation::CanceledOrFailed}) {
+        auto chain = MakeChain(pool, propagation);
+        chain.a->cancel();
+        CHECK(chain.b->isCanceled() && chain.c->isCanceled());
+        CHECK(chain.b->runs == 0 && chain.c->runs == 0);
+    }
+    Shutdown(pool);
+}
+
+void TestFailureSpreadsOnlyWhenAsked() {
+    auto pool = MakeThreadPoolExecutor(2);
+    auto fail = []() { throw std::runtime_error("a"); };
+
+    auto chain = MakeChain(pool, CancelPropagation::CanceledOrFailed, fail);
+    pool->submit(chain.a);
+    chain.c->wait();
+    CHECK(chain.a->isFailed());
+    CHECK(chain.b->isCanceled() && chain.c->isCanceled());
+    CHECK(chain.b->runs == 0 && chain.c->runs == 0);
+
+    // a failure is not a cancellation, the dependents run and see it themselves
+    chain = MakeChain(pool, CancelPropagation::Canceled, fail);
+    pool->submit(chain.a);
+    chain.c->wait();
+    CHECK(chain.b->isCompleted() && chain.c->isCompleted());
+    CHECK(chain.b->runs == 1 && chain.c->runs == 1);
+    Shutdown(pool);
+}
+
+void TestNoneRunsDependents() {
+    auto pool = MakeThreadPoolExecutor(2);
+    auto chain = MakeChain(pool, CancelPropagation::None);
+    chain.a->cancel();
+    chain.c->wait();
+    CHECK(chain.b->isCompleted() && chain.c->isCompleted());
+    CHECK(chain.b->runs == 1 && chain.c->runs == 1);
+    Shutdown(pool);
+}
+
+void TestStartedTaskIsNotCanceled() {
+    auto pool = MakeThreadPoolExecutor(2);
+    std::atomic<bool> started{false}, release{false};
+    auto task = std::make_shared<CountingTask>([&]() {
+        started = true;
+        CHECK(Eventually([&]() { return release.load(); }));
+    });
+    task->setCancelPropagation(CancelPropagation::CanceledOrFailed);
+    pool->submit(task);
+    CHECK(Eventually([&]() { return started.load(); }));
+
+    auto canceled = std::make_shared<CountingTask>();
+    canceled->cancel();
+    task->addDependency(canceled);
+    CHECK(!task->isCanceled());
+    release = true;
+    task->wait();
+    CHECK(task->isCompleted());
+    Shutdown(pool);
+}
+
+void TestDependencyOnFinishedTask() {
+    auto pool = MakeThreadPoolExecutor(2);
+    auto canceled = std::make_shared<CountingTask>();
+    canceled->cancel();
+    auto dependent = std::make_shared<CountingTask>();
+    dependent->setCancelPropagation(CancelPropagation::Canceled);
+    dependent->addDependency(canceled);
+    CHECK(dependent->isCanceled());
+    pool->submit(dependent);
+
+    auto failed = std::make_shared<CountingTask>([]() { throw std::runtime_error("failed"); });
+    pool->submit(failed);
+    failed->wait();
+    auto strict = std::make_shared<CountingTask>();
+    strict->setCancelPropagation(CancelPropagation::CanceledOrFailed);
+    strict->addDependency(failed);
+    CHECK(strict->isCanceled());
+    auto lenient = std::make_shared<CountingTask>();
+    lenient->setCancelPropagation(CancelPropagation::Canceled);
+    lenient->addDependency(failed);
+    CHECK(!lenient->isCanceled());
+    pool->submit(lenient);
+    lenient->wait();
+    CHECK(lenient->isCompleted());
+
+    Shutdown(pool);
+    CHECK(dependent->runs == 0 && strict->runs == 0);
+}
+
+// the subtree is canceled in a loop, not by recursion
+void TestDeepChain() {
+    auto pool = MakeThreadPoolExecutor(2);
+    const int kTasks = 100000;
+    std::vector<std::shared_ptr<CountingTask>> tasks;
+    tasks.push_back(std::make_shared<CountingTask>());
+    for (int ind = 1; ind < kTasks; ++ind) {
+        auto task = std::make_shared<CountingTask>();
+        task->setCancelPropagation(CancelPropagation::Canceled);
+        task->addDependency(tasks.back());
+        pool->submit(task);
+        tasks.push_back(std::move(task));
+    }
+    tasks.front()->cancel();
+    for (const auto& task : tasks) {
+        CHECK(task->isCanceled() && task->runs == 0);
+    }
+    Shutdown(pool);
+}
+
+int main() {
+    return RunTests({{"Cancellation.CancelSpreadsDownTheChain", TestCancelSpreadsDownTheChain},
+                     {"Cancellation.FailureSpreadsOnlyWhenAsked", TestFailureSpreadsOnlyWhenAsked},
+                     {"Cancellation.NoneRunsDependents", TestNoneRunsDependents},
+                     {"Cancellation.StartedTaskIsNotCanceled", TestStartedTaskIsNotCanceled},
+                     {"Cancellation.DependencyOnFinishedTask", TestDependencyOnFinishedTask},
+                     {"Cancellation.DeepChain", TestDeepChain}});
+}
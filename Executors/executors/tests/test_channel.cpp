@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include "channel.h"
+#include "check.h"
+
+void TestZeroCapacityThrows() {
+    CHECK(Throws<std::invalid_argument>([]() { Channel<int> channel(0); }));
+}
+
+void TestTryVariants() {
+    Channel<int> channel(2);
+    CHECK(!channel.tryPop());
+    CHECK(channel.tryPush(1));
+    CHECK(channel.tryPush(2));
+    CHECK(!channel.tryPush(3));
+    CHECK(*channel.tryPop() == 1);
+    CHECK(channel.tryPush(3));
+    CHECK(*channel.tryPop() == 2);
+    CHECK(*channel.tryPop() == 3);
+    CHECK(!channel.tryPop());
+}
+
+void TestPushBlocksWhileFull() {
+    Channel<int> channel(1);
+    CHECK(channel.push(1));
+    std::atomic<bool> pushed{false};
+    std::thread producer([&]() {
+        channel.push(2);
+        pushed = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(!pushed.load());
+    CHECK(*channel.pop() == 1);
+    CHECK(Eventually([&]() { return pushed.load(); }));
+    CHECK(*channel.pop() == 2);
+    producer.join();
+}
+
+void TestPopBlocksWhileEmpty() {
+    Channel<std::string> channel(4);
+    std::atomic<bool> popped{false};
+    std::optional<std::string> value;
+    std::thread consumer([&]() {
+        value = channel.pop();
+        popped = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(!popped.load());
+    CHECK(channel.push("item"));
+    consumer.join();
+    CHECK(value && *value == "item");
+}
+
+void TestCloseWakesBlockedSenders() {
+    Channel<int> channel(1);
+    CHECK(channel.push(1));
+    std::atomic<int> failed{0};
+    std::vector<std::thread> producers;
+    for (int ind = 0; ind < 3; ++ind) {
+        producers.emplace_back([&]() {
+            if (!channel.push(2)) {
+                ++failed;
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    channel.close();
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    CHECK(failed.load() == 3);
+    CHECK(channel.isClosed());
+    // what was pushed before close is still there
+    CHECK(*channel.pop() == 1);
+    CHECK(!channel.pop());
+}
+
+void TestCloseWakesBlockedReceivers() {
+    Channel<int> channel(1);
+    std::atomic<int> empty{0};
+    std::vector<std::thread> consumers;
+    for (int ind = 0; ind < 2; ++ind) {
+        consumers.emplace_back([&]() {
+            if (!channel.pop()) {
+                ++empty;
+            }
+        });
+    }
+    consumers.emplace_back([&]() {
+        if (channel.popBatch(8).empty()) {
+            ++empty;
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    channel.close();
+    for (auto& consumer : consumers) {
+        consumer.join();
+    }
+    CHECK(empty.load() == 3);
+    CHECK(!channel.tryPush(1));
+}
+
+void TestPopBatch() {
+    Channel<int> channel(8);
+    for (int ind = 0; ind < 5; ++ind) {
+        CHECK(channel.push(ind));
+    }
+    auto batch = channel.popBatch(3);
+    CHECK((batch == std::vector<int>{0, 1, 2}));
+    batch = channel.popBatch(3);
+    CHECK((batch == std::vector<int>{3, 4}));
+}
+
+// every item pushed by any producer is popped exactly once
+void TestManyProducersManyConsumers() {
+    const int kProducers = 4;
+    const int kConsumers = 4;
+    const int kItems = 10000;
+    Channel<int> channel(16);
+
+    std::vector<std::thread> producers;
+    for (int producer = 0; producer < kProducers; ++producer) {
+        producers.emplace_back([&, producer]() {
+            for (int ind = 0; ind < kItems; ++ind) {
+                channel.push(producer * kItems + ind);
+            }
+        });
+    }
+    std::vector<std::vector<int>> received(kConsumers);
+    std::vector<std::thread> consumers;
+    for (int consumer = 0; consumer < kConsumers; ++consumer) {
+        consumers.emplace_back([&, consumer]() {
+            while (auto value = channel.pop()) {
+                received[consumer].push_back(*value);
+            }
+        });
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    channel.close();
+    for (auto& consumer : consumers) {
+        consumer.join();
+    }
+
+    std::vector<int> all;
+    for (const auto& part : received) {
+        all.insert(all.end(), part.begin(), part.end());
+    }
+    std::sort(all.begin(), all.end());
+    CHECK(all.size() == size_t(kProducers * kItems));
+    for (int ind = 0; ind < kProducers * kItems; ++ind) {
+        CHECK(all[ind] == ind);
+    }
+}
+
+int main() {
+    return RunTests({{"Channel.ZeroCapacityThrows", TestZeroCapacityThrows},
+                     {"Channel.TryVariants", TestTryVariants},
+                     {"Channel.PushBlocksWhileFull", TestPushBlocksWhileFull},
+                     {"Channel.PopBlocksWhileEmpty", TestPopBlocksWhileEmpty},
+                     {"Channel.CloseWakesBlockedSenders", TestCloseWakesBlockedSenders},
+                     {"Channel.CloseWakesBlockedReceivers", TestCloseWakesBlockedReceivers},
+                     {"Channel.PopBatch", TestPopBatch},
+                     {"Channel.ManyProducersManyConsumers", TestManyProducersManyConsumers}});
+}
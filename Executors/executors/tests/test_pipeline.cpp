@@ -0,0 +1,114 @@
+#include <atomic>
+#include "check.h"
+#include "pipeline.h"
+
+void TestSumsInOrder() {
+    auto pool = MakeThreadPoolExecutor(4);
+    Pipeline pipeline(pool, 8);
+    int next = 0;
+    pipeline.setSource<int>([&]() -> std::optional<int> {
+        if (next == 1000) {
+            return std::nullopt;
+        }
+        return next++;
+    });
+    pipeline.addStage<int, int>(Pipeline::Mode::Parallel, [](int x) { return x * 2; });
+    std::vector<int> seen;
+    pipeline.addSink<int>(Pipeline::Mode::SerialInOrder, [&](int x) { seen.push_back(x); });
+    pipeline.run()->get();
+
+    CHECK(seen.size() == 1000u);
+    for (int ind = 0; ind < 1000; ++ind) {
+        CHECK(seen[ind] == ind * 2);
+    }
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+// every item frees the only token for the next one, that must not nest calls
+void TestSingleTokenManyItems() {
+    auto pool = MakeThreadPoolExecutor(1);
+    Pipeline pipeline(pool, 1);
+    const int kItems = 200000;
+    int next = 0;
+    pipeline.setSource<int>([&]() -> std::optional<int> {
+        if (next == kItems) {
+            return std::nullopt;
+        }
+        return next++;
+    });
+    pipeline.addStage<int, int>(Pipeline::Mode::SerialInOrder, [](int x) { return x + 1; });
+    int64_t sum = 0;
+    pipeline.addSink<int>(Pipeline::Mode::Parallel, [&](int x) { sum += x; });
+    pipeline.run()->get();
+
+    CHECK(sum == int64_t(kItems) * (kItems + 1) / 2);
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+void TestStageErrorFailsRun() {
+    auto pool = MakeThreadPoolExecutor(2);
+    Pipeline pipeline(pool, 4);
+    int next = 0;
+    pipeline.setSource<int>([&]() -> std::optional<int> { return next++; });
+    std::atomic<int> passed{0};
+    pipeline.addSink<int>(Pipeline::Mode::Parallel, [&](int x) {
+        if (x == 100) {
+            throw std::runtime_error("stage");
+        }
+        ++passed;
+    });
+    CHECK(Throws<std::runtime_error>([&]() { pipeline.run()->get(); }));
+    CHECK(passed.load() >= 100 - 4);
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+void TestShutDownExecutorFinishesRun() {
+    auto pool = MakeThreadPoolExecutor(2);
+    pool->startShutdown();
+    pool->waitShutdown();
+
+    Pipeline pipeline(pool, 4);
+    int next = 0;
+    pipeline.setSource<int>([&]() -> std::optional<int> { return next++; });
+    pipeline.addSink<int>(Pipeline::Mode::Parallel, [](int) {});
+    auto done = pipeline.run();
+    done->wait();
+    CHECK(done->isCanceled());
+    CHECK(next == 0);
+}
+
+// the executor refuses the tasks spawned after shutdown, the run must still finish
+void TestShutdownWhileRunning() {
+    auto pool = MakeThreadPoolExecutor(2);
+    Pipeline pipeline(pool, 4);
+    std::atomic<bool> entered{false}, released{false};
+    int next = 0;
+    pipeline.setSource<int>([&]() -> std::optional<int> {
+        entered = true;
+        while (!released) {
+            std::this_thread::yield();
+        }
+        return next++;
+    });
+    pipeline.addStage<int, int>(Pipeline::Mode::SerialInOrder, [](int x) { return x; });
+    pipeline.addSink<int>(Pipeline::Mode::Parallel, [](int) {});
+    auto done = pipeline.run();
+
+    CHECK(Eventually([&]() { return entered.load(); }));
+    pool->startShutdown();
+    released = true;
+    done->wait();
+    CHECK(done->isFinished());
+    pool->waitShutdown();
+}
+
+int main() {
+    return RunTests({{"Pipeline.SumsInOrder", TestSumsInOrder},
+                     {"Pipeline.SingleTokenManyItems", TestSingleTokenManyItems},
+                     {"Pipeline.StageErrorFailsRun", TestStageErrorFailsRun},
+                     {"Pipeline.ShutDownExecutorFinishesRun", TestShutDownExecutorFinishesRun},
+                     {"Pipeline.ShutdownWhileRunning", TestShutdownWhileRunning}});
+}
@@ -0,0 +1,126 @@
+#include <atomic>
+#include "check.h"
+#include "pool.h"
+
+namespace {
+std::atomic<int> exited_threads{0};
+
+// counts threads that touched it once they exit
+struct ExitCounter {
+    ~ExitCounter() {
+        ++exited_threads;
+    }
+};
+thread_local ExitCounter exit_counter;
+
+std::shared_ptr<ThreadPool> MakeGrowablePool(int max_threads, int keep_alive_ms) {
+    return std::make_shared<ThreadPool>(max_threads, std::chrono::milliseconds(keep_alive_ms));
+}
+}  // namespace
+
+void TestGrowsOnDemand() {
+    auto pool = MakeGrowablePool(4, 1000);
+    std::atomic<int> running{0};
+    std::vector<FuturePtr<bool>> futures;
+    // every task waits for all four to run at once, which takes four threads
+    for (int ind = 0; ind < 4; ++ind) {
+        futures.push_back(pool->invoke<bool>([&]() {
+            ++running;
+            return Eventually([&]() { return running == 4; });
+        }));
+    }
+    for (auto& future : futures) {
+        CHECK(future->get());
+    }
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+void TestStaysWithinMaxThreads() {
+    auto pool = MakeGrowablePool(2, 1000);
+    std::atomic<int> running{0}, max_running{0};
+    std::vector<FuturePtr<Unit>> futures;
+    for (int ind = 0; ind < 16; ++ind) {
+        futures.push_back(pool->invoke<Unit>([&]() {
+            int now = ++running;
+            int seen = max_running;
+            while (now > seen && !max_running.compare_exchange_weak(seen, now)) {
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            --running;
+            return Unit{};
+        }));
+    }
+    for (auto& future : futures) {
+        future->get();
+    }
+    CHECK(max_running <= 2);
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+void TestIdleThreadsRetire() {
+    auto pool = MakeGrowablePool(2, 20);
+    int exited_before = exited_threads;
+    pool->invoke<Unit>([]() {
+          (void)&exit_counter;
+          return Unit{};
+      })->get();
+    CHECK(Eventually([&]() { return exited_threads == exited_before + 1; }));
+
+    // and a new one comes for the next task
+    CHECK(pool->invoke<int>([]() { return 1; })->get() == 1);
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+// tasks submitted right when the only worker times out must still run
+void TestNoStrandedTaskAtMaxThreads() {
+    auto pool = MakeGrowablePool(1, 1);
+    for (int ind = 0; ind < 500; ++ind) {
+        auto future = pool->invoke<Unit>([]() { return Unit{}; });
+        CHECK(Eventually([&]() { return future->isFinished(); }, std::chrono::seconds(2)));
+        std::this_thread::sleep_for(std::chrono::microseconds(900 + ind % 200));
+    }
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+void TestMarkAsBlockingKeepsPoolSize() {
+    auto pool = MakeThreadPoolExecutor(2);
+    std::atomic<bool> release{false};
+    std::vector<FuturePtr<bool>> blocked;
+    for (int ind = 0; ind < 2; ++ind) {
+        blocked.push_back(pool->invoke<bool>([&]() {
+            MarkAsBlocking();
+            return Eventually([&]() { return release.load(); });
+        }));
+    }
+
+    // both blocked tasks hold their threads, two CPU tasks still run side by side
+    std::atomic<int> running{0};
+    std::vector<FuturePtr<bool>> cpu;
+    for (int ind = 0; ind < 2; ++ind) {
+        cpu.push_back(pool->invoke<bool>([&]() {
+            ++running;
+            return Eventually([&]() { return running == 2; });
+        }));
+    }
+    for (auto& future : cpu) {
+        CHECK(future->get());
+    }
+    release = true;
+    for (auto& future : blocked) {
+        CHECK(future->get());
+    }
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+int main() {
+    return RunTests({{"Pool.GrowsOnDemand", TestGrowsOnDemand},
+                     {"Pool.StaysWithinMaxThreads", TestStaysWithinMaxThreads},
+                     {"Pool.IdleThreadsRetire", TestIdleThreadsRetire},
+                     {"Pool.NoStrandedTaskAtMaxThreads", TestNoStrandedTaskAtMaxThreads},
+                     {"Pool.MarkAsBlockingKeepsPoolSize", TestMarkAsBlockingKeepsPoolSize}});
+}
@@ -0,0 +1,168 @@
+#include <unistd.h>
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+#include "check.h"
+#include "reactor.h"
+
+namespace {
+struct Pipe {
+    Pipe() {
+        CHECK(pipe(fds) == 0);
+    }
+    ~Pipe() {
+        CloseRead();
+        CloseWrite();
+    }
+    void CloseRead() {
+        if (fds[0] >= 0) {
+            close(fds[0]);
+            fds[0] = -1;
+        }
+    }
+    void CloseWrite() {
+        if (fds[1] >= 0) {
+            close(fds[1]);
+            fds[1] = -1;
+        }
+    }
+
+    int fds[2] = {-1, -1};
+};
+}  // namespace
+
+void TestWaitsForPipeData() {
+    auto pool = MakeThreadPoolExecutor(2);
+    Reactor reactor(pool);
+    Pipe pipe;
+
+    auto read = reactor.read(pipe.fds[0], 16);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(!read->isFinished());
+
+    auto written = reactor.write(pipe.fds[1], "hello");
+    CHECK(written->get() == 5u);
+    CHECK(read->get() == "hello");
+
+    reactor.shutdown();
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+void TestPeerCloseWakesReader() {
+    auto pool = MakeThreadPoolExecutor(2);
+    Reactor reactor(pool);
+    Pipe pipe;
+
+    auto read = reactor.read(pipe.fds[0], 16);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(!read->isFinished());
+    pipe.CloseWrite();
+    CHECK(read->get() == "");
+
+    reactor.shutdown();
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+// epoll refuses regular files with EPERM, reads go to the blocking executor
+void TestReadsRegularFile() {
+    auto pool = MakeThreadPoolExecutor(2);
+    Reactor reactor(pool);
+
+    char path[] = "/tmp/reactor_testXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    unlink(path);
+    CHECK(::write(fd, "file data", 9) == 9);
+    CHECK(lseek(fd, 0, SEEK_SET) == 0);
+
+    CHECK(reactor.read(fd, 64)->get() == "file data");
+    CHECK(reactor.read(fd, 64)->get() == "");
+    close(fd);
+
+    reactor.shutdown();
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+void TestCanceledWaitDoesNotRun() {
+    auto pool = MakeThreadPoolExecutor(2);
+    Reactor reactor(pool);
+    Pipe pipe;
+
+    std::atomic<bool> ran{false};
+    auto canceled = reactor.invokeWhen<Unit>(pipe.fds[0], Reactor::Event::Readable, [&]() {
+        ran = true;
+        return Unit{};
+    });
+    canceled->cancel();
+    CHECK(canceled->isCanceled());
+
+    // the second waiter on the same fd is woken by the same event
+    auto read = reactor.read(pipe.fds[0], 16);
+    CHECK(::write(pipe.fds[1], "x", 1) == 1);
+    CHECK(read->get() == "x");
+    CHECK(!ran);
+
+    reactor.shutdown();
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+void TestShutdownCancelsPendingWaits() {
+    auto pool = MakeThreadPoolExecutor(2);
+    Reactor reactor(pool);
+    Pipe pipe;
+
+    auto read = reactor.read(pipe.fds[0], 16);
+    auto write_wait = reactor.invokeWhen<Unit>(pipe.fds[1], Reactor::Event::Readable,
+                                               []() { return Unit{}; });
+    reactor.shutdown();
+    read->wait();
+    write_wait->wait();
+    CHECK(read->isCanceled());
+    CHECK(write_wait->isCanceled());
+
+    // waits after shutdown are canceled right away
+    auto late = reactor.read(pipe.fds[0], 16);
+    CHECK(late->isCanceled());
+
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+// a dup closed under the reactor stays in epoll, its next event fails the
+// re-registration, the waiters of the other direction must not be left behind
+void TestClosedDupWakesAllWaiters() {
+    auto pool = MakeThreadPoolExecutor(2);
+    Reactor reactor(pool);
+    Pipe pipe;
+    int dup_fd = dup(pipe.fds[0]);
+    CHECK(dup_fd >= 0);
+
+    auto reader = reactor.invokeWhen<Unit>(dup_fd, Reactor::Event::Readable,
+                                           []() { return Unit{}; });
+    // the read end never becomes writable
+    auto writer = reactor.invokeWhen<Unit>(dup_fd, Reactor::Event::Writable,
+                                           []() { return Unit{}; });
+    close(dup_fd);
+    CHECK(::write(pipe.fds[1], "x", 1) == 1);
+
+    CHECK(Eventually([&]() { return reader->isFinished() && writer->isFinished(); }));
+    CHECK(reader->isCompleted());
+    CHECK(writer->isCompleted());
+
+    reactor.shutdown();
+    pool->startShutdown();
+    pool->waitShutdown();
+}
+
+int main() {
+    return RunTests({{"Reactor.WaitsForPipeData", TestWaitsForPipeData},
+                     {"Reactor.PeerCloseWakesReader", TestPeerCloseWakesReader},
+                     {"Reactor.ReadsRegularFile", TestReadsRegularFile},
+                     {"Reactor.CanceledWaitDoesNotRun", TestCanceledWaitDoesNotRun},
+                     {"Reactor.ShutdownCancelsPendingWaits", TestShutdownCancelsPendingWaits},
+                     {"Reactor.ClosedDupWakesAllWaiters", TestClosedDupWakesAllWaiters}});
+}
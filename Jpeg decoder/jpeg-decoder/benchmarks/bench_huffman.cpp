@@ -0,0 +1,161 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "bit_reader.h"
+#include "huffman.h"
+
+namespace {
+const int kSymbols = 1 << 16;
+
+struct HuffmanTable {
+    std::vector<int> codes_number;
+    std::vector<uint8_t> codes_values;
+};
+
+// tables of every DHT segment, 0xFFC4 can't occur inside stuffed scan data
+std::vector<HuffmanTable> ReadTables(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)),
+                               std::istreambuf_iterator<char>());
+    std::vector<HuffmanTable> tables;
+    for (size_t pos = 0; pos + 4 <= bytes.size(); ++pos) {
+        if (bytes[pos] != 0xFF || bytes[pos + 1] != 0xC4) {
+            continue;
+        }
+        size_t end = std::min(bytes.size(), pos + 2 + (bytes[pos + 2] << 8 | bytes[pos + 3]));
+        size_t cur = pos + 4;
+        while (cur + 17 <= end) {
+            HuffmanTable table;
+            // skip the table class and id
+            ++cur;
+            size_t total = 0;
+            for (int len = 0; len < 16; ++len) {
+                table.codes_number.push_back(bytes[cur]);
+                total += bytes[cur++];
+            }
+            if (cur + total > end) {
+                break;
+            }
+            table.codes_values.assign(bytes.begin() + cur, bytes.begin() + cur + total);
+            cur += total;
+            tables.push_back(std::move(table));
+        }
+    }
+    return tables;
+}
+
+struct SymbolStream {
+    std::unique_ptr<HuffmanDecoder> decoder = std::make_unique<HuffmanDecoder>();
+    std::vector<uint8_t> symbols;
+    std::vector<uint8_t> data;
+};
+
+// kSymbols random symbols of the table, a code of length len comes with
+// probability 2^-len, which is what the table is optimal for
+SymbolStream EncodeRandomSymbols(const HuffmanTable& table, std::mt19937* gen) {
+    SymbolStream stream;
+    stream.decoder->BuildTree(table.codes_number, table.codes_values);
+
+    std::vector<std::pair<uint32_t, int>> codes;
+    std::vector<double> weights;
+    uint32_t code = 0;
+    for (int len = 1; len <= 16; ++len) {
+        for (int ind = 0; ind < table.codes_number[len - 1]; ++ind) {
+            codes.emplace_back(code++, len);
+            weights.push_back(1.0 / (1 << len));
+        }
+        code <<= 1;
+    }
+    std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+
+    uint64_t buffer = 0;
+    int bits = 0;
+    for (int ind = 0; ind < kSymbols; ++ind) {
+        size_t code_ind = pick(*gen);
+        stream.symbols.push_back(table.codes_values[code_ind]);
+        auto [ code_bits, len ] = codes[code_ind];
+        buffer = (buffer << len) | code_bits;
+        bits += len;
+        while (bits >= 8) {
+            stream.data.push_back(static_cast<uint8_t>(buffer >> (bits - 8)));
+            bits -= 8;
+        }
+    }
+    if (bits > 0) {
+        stream.data.push_back(static_cast<uint8_t>(buffer << (8 - bits)));
+    }
+    return stream;
+}
+
+using Decode = uint8_t (HuffmanDecoder::*)(BitReader*) const;
+
+// decodes the streams of all tables of one file, as a decoder switching
+// between DC and AC tables would touch all of them
+void DecodeStreams(benchmark::State& state, const std::vector<SymbolStream>& streams,
+                   Decode decode) {
+    for (const auto& stream : streams) {
+        BitReader reader(stream.data.data(), stream.data.data() + stream.data.size());
+        for (uint8_t symbol : stream.symbols) {
+            if ((stream.decoder.get()->*decode)(&reader) != symbol) {
+                state.SkipWithError("Decoded a wrong symbol");
+                return;
+            }
+        }
+    }
+    for (auto _ : state) {
+        for (const auto& stream : streams) {
+            BitReader reader(stream.data.data(), stream.data.data() + stream.data.size());
+            for (int ind = 0; ind < kSymbols; ++ind) {
+                benchmark::DoNotOptimize((stream.decoder.get()->*decode)(&reader));
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * kSymbols * streams.size());
+}
+}  // namespace
+
+// Symbol decoding through the lookup table against the bit by bit tree walk,
+// on the Huffman tables of every file in jpeg-examples:
+//   ./bench_huffman --benchmark_filter=lenna
+int main(int argc, char** argv) {
+    std::vector<std::string> paths;
+    for (const auto& entry : std::filesystem::directory_iterator(EXAMPLES_DIR)) {
+        if (entry.path().extension() == ".jpg") {
+            paths.push_back(entry.path().string());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+
+    std::mt19937 gen(20261019);
+    for (const auto& path : paths) {
+        auto streams = std::make_shared<std::vector<SymbolStream>>();
+        for (const auto& table : ReadTables(path)) {
+            streams->push_back(EncodeRandomSymbols(table, &gen));
+        }
+        if (streams->empty()) {
+            continue;
+        }
+        auto name = std::filesystem::path(path).filename().string();
+        benchmark::RegisterBenchmark(("BM_LookupTable/" + name).c_str(),
+                                     [streams](benchmark::State& state) {
+                                         DecodeStreams(state, *streams,
+                                                       &HuffmanDecoder::DecodeSymbol);
+                                     });
+        benchmark::RegisterBenchmark(("BM_TreeWalk/" + name).c_str(),
+                                     [streams](benchmark::State& state) {
+                                         DecodeStreams(state, *streams,
+                                                       &HuffmanDecoder::DecodeSymbolByTree);
+                                     });
+    }
+
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
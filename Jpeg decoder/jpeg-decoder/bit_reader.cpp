@@ -1,26 +1,80 @@
 #include "bit_reader.h"
 #include "errors.h"
 
-int BitReader::Get() {
-    if (bit_pos_ == 8) {
-        Expect(in_stream_.peek() != EOF, "Reached the end of file");
-        uint8_t old_byte = cur_byte_;
-        cur_byte_ = in_stream_.get();
-        if (skip_rule_ && old_byte == byte_before_ && cur_byte_ == skip_byte_) {
-            cur_byte_ = in_stream_.get();
+namespace {
+// true if some byte of word equals byte
+bool HasByte(uint64_t word, uint8_t byte) {
+    const uint64_t kLows = 0x0101010101010101ull;
+    const uint64_t kHighs = 0x8080808080808080ull;
+    uint64_t diff = word ^ (kLows * byte);
+    return ((diff - kLows) & ~diff & kHighs) != 0;
+}
+
+uint64_t LoadBigEndian(const uint8_t* bytes) {
+    uint64_t word = 0;
+    for (int ind = 0; ind < 8; ++ind) {
+        word = (word << 8) | bytes[ind];
+    }
+    return word;
+}
+}  // namespace
+
+void BitReader::RefillByte() {
+    uint64_t byte = 0;
+    if (data_ended_ || cur_ == end_) {
+        data_ended_ = true;
+        padding_bits_ += 8;
+    } else {
+        byte = *cur_++;
+        if (skip_rule_ && byte == byte_before_) {
+            if (cur_ != end_ && *cur_ == skip_byte_) {
+                ++cur_;
+            } else {
+                // data is over, stay on the marker
+                --cur_;
+                data_ended_ = true;
+                byte = 0;
+                padding_bits_ += 8;
+            }
         }
-        bit_pos_ = 0;
     }
-    int bit = (cur_byte_ >> (7 - bit_pos_)) & 1;
-    ++bit_pos_;
-    return bit;
+    buffer_ |= byte << (56 - bits_in_buffer_);
+    bits_in_buffer_ += 8;
 }
 
-int BitReader::Get(int len) {
-    int res = 0;
-    for (int ind = 0; ind < len; ++ind) {
-        res = (res << 1) + Get();
+void BitReader::Refill() {
+    // fast path: take all whole bytes that fit if there is nothing to unstuff
+    if (!data_ended_ && end_ - cur_ >= 8) {
+        uint64_t word = LoadBigEndian(cur_);
+        if (!skip_rule_ || !HasByte(word, byte_before_)) {
+            int bytes = (64 - bits_in_buffer_) / 8;
+            buffer_ |= (word >> (8 * (8 - bytes))) << (64 - bits_in_buffer_ - 8 * bytes);
+            bits_in_buffer_ += 8 * bytes;
+            cur_ += bytes;
+            return;
+        }
     }
+    while (bits_in_buffer_ <= 56) {
+        RefillByte();
+    }
+}
+
+void BitReader::Consume(int len) {
+    if (bits_in_buffer_ < len) {
+        Refill();
+    }
+    Expect(bits_in_buffer_ - len >= padding_bits_, "Reached the end of file");
+    buffer_ <<= len;
+    bits_in_buffer_ -= len;
+}
+
+int BitReader::Get() {
+    return Get(1);
+}
+
+int BitReader::Get(int len) {
+    int res = Peek(len);
+    Consume(len);
     return res;
 }
 
@@ -28,4 +82,4 @@ void BitReader::SetSkipRule(uint8_t byte_before, uint8_t skip_byte) {
     skip_rule_ = true;
     byte_before_ = byte_before;
     skip_byte_ = skip_byte;
-}
\ No newline at end of file
+}
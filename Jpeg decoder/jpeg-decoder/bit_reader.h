@@ -1,19 +1,41 @@
 #pragma once
-#include <fstream>
+#include <cstddef>
+#include <cstdint>
 
+// Reads bits of the [begin, end) buffer through a 64-bit accumulator
+// refilled several bytes at a time.
 class BitReader {
 public:
-    explicit BitReader(std::istream& in_stream)
-        : in_stream_(in_stream), cur_byte_(in_stream_.get()){};
+    BitReader(const uint8_t* begin, const uint8_t* end)
+        : cur_(begin), end_(end) {}
 
     int Get();
     int Get(int len);  // returns number stacked from next len bits
+    // next len bits (at most kMaxPeek) without moving forward,
+    // zeros go after the end of data
+    int Peek(int len) {
+        if (bits_in_buffer_ < len) {
+            Refill();
+        }
+        return len == 0 ? 0 : static_cast<int>(buffer_ >> (64 - len));
+    }
+    void Consume(int len);
+    // skip_byte after byte_before is dropped, any other byte after
+    // byte_before ends the data (it's a marker in jpg)
     void SetSkipRule(uint8_t byte_before, uint8_t skip_byte);
 
+    static const int kMaxPeek = 24;
+
 private:
-    std::istream& in_stream_;
-    uint8_t cur_byte_;
-    int bit_pos_ = 0;
+    void Refill();
+    void RefillByte();
+
+    const uint8_t* cur_;
+    const uint8_t* end_;
+    uint64_t buffer_ = 0;  // bits_in_buffer_ next bits, aligned to the top
+    int bits_in_buffer_ = 0;
+    int padding_bits_ = 0;  // zeros in buffer_ that were added after the data
+    bool data_ended_ = false;
     bool skip_rule_ = false;
     uint8_t byte_before_, skip_byte_;
 };
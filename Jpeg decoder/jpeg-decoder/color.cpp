@@ -0,0 +1,203 @@
+#include "color.h"
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+const int kScaleBits = 14;
+const int kHalf = 1 << (kScaleBits - 1);
+
+// JFIF coefficients scaled by 2^kScaleBits, all fit into int16
+const int kCrToR = 22970;   // 1.402
+const int kCbToG = -5638;   // -0.34414
+const int kCrToG = -11700;  // -0.71414
+const int kCbToB = 29032;   // 1.772
+
+uint8_t Clamp(int value) {
+    return static_cast<uint8_t>(std::min(std::max(0, value), 255));
+}
+
+void UpsampleNearest(const uint8_t* in, int factor, uint8_t* out, int out_width) {
+    for (int col = 0; col < out_width; ++col) {
+        out[col] = in[col / factor];
+    }
+}
+
+// 3/4 * nearer + 1/4 * further sample, ties broken alternately
+void UpsampleFancyH2(const uint8_t* in, int in_width, uint8_t* out) {
+    if (in_width == 1) {
+        out[0] = out[1] = in[0];
+        return;
+    }
+    out[0] = in[0];
+    out[1] = (in[0] * 3 + in[1] + 2) >> 2;
+    for (int col = 1; col < in_width - 1; ++col) {
+        int value = in[col] * 3;
+        out[2 * col] = (value + in[col - 1] + 1) >> 2;
+        out[2 * col + 1] = (value + in[col + 1] + 2) >> 2;
+    }
+    int last = in_width - 1;
+    out[2 * last] = (in[last] * 3 + in[last - 1] + 1) >> 2;
+    out[2 * last + 1] = in[last];
+}
+
+void UpsampleFancyV2(const uint8_t* cur, const uint8_t* near, int bias, int width,
+                     uint8_t* out) {
+    for (int col = 0; col < width; ++col) {
+        out[col] = (cur[col] * 3 + near[col] + bias) >> 2;
+    }
+}
+
+// both directions at once, the vertical sums keep 4 bits until the end
+void UpsampleFancyH2V2(const uint8_t* cur, const uint8_t* near, int in_width, uint8_t* out) {
+    auto sum = [&](int col) { return cur[col] * 3 + near[col]; };
+    if (in_width == 1) {
+        out[0] = out[1] = (sum(0) * 4 + 8) >> 4;
+        return;
+    }
+    out[0] = (sum(0) * 4 + 8) >> 4;
+    out[1] = (sum(0) * 3 + sum(1) + 7) >> 4;
+    for (int col = 1; col < in_width - 1; ++col) {
+        int value = sum(col) * 3;
+        out[2 * col] = (value + sum(col - 1) + 8) >> 4;
+        out[2 * col + 1] = (value + sum(col + 1) + 7) >> 4;
+    }
+    int last = in_width - 1;
+    out[2 * last] = (sum(last) * 3 + sum(last - 1) + 8) >> 4;
+    out[2 * last + 1] = (sum(last) * 4 + 7) >> 4;
+}
+
+void YCbCrToRgbScalar(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, uint8_t* rgb,
+                      int width, int channels) {
+    for (int col = 0; col < width; ++col) {
+        int blue = cb[col] - 128;
+        int red = cr[col] - 128;
+        uint8_t* dst = rgb + channels * col;
+        dst[0] = Clamp(y[col] + ((red * kCrToR + kHalf) >> kScaleBits));
+        dst[1] = Clamp(y[col] + ((blue * kCbToG + red * kCrToG + kHalf) >> kScaleBits));
+        dst[2] = Clamp(y[col] + ((blue * kCbToB + kHalf) >> kScaleBits));
+        if (channels == 4) {
+            dst[3] = 255;
+        }
+    }
+}
+
+#ifdef __SSE2__
+// 8 int16 products of (a, b) pairs with (ka, kb), descaled
+__m128i MulAdd(__m128i a, __m128i b, __m128i k) {
+    __m128i lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), k), kScaleBits);
+    __m128i hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), k), kScaleBits);
+    return _mm_packs_epi32(lo, hi);
+}
+
+// 8 pixels of one channel from y and the color difference terms
+__m128i Channel(__m128i y, __m128i a, __m128i b, __m128i k) {
+    return _mm_add_epi16(y, MulAdd(a, b, k));
+}
+
+// gives the same values as the scalar version, the rounding constant rides
+// along in madd as a second factor of one
+int YCbCrToRgbSse2(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, uint8_t* rgb,
+                   int width, int channels) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i red_k = _mm_set1_epi32((kHalf << 16) | kCrToR);
+    const __m128i blue_k = _mm_set1_epi32((kHalf << 16) | kCbToB);
+    const __m128i green_k =
+        _mm_set1_epi32((static_cast<uint32_t>(kCrToG) << 16) | (kCbToG & 0xffff));
+    const __m128i half = _mm_set1_epi32(kHalf);
+
+    alignas(16) uint8_t planes[3][16];
+    int col = 0;
+    for (; col + 16 <= width; col += 16) {
+        __m128i y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + col));
+        __m128i cb8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cb + col));
+        __m128i cr8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cr + col));
+        __m128i out[3][2];
+        for (int half_ind = 0; half_ind < 2; ++half_ind) {
+            __m128i y16 = half_ind ? _mm_unpackhi_epi8(y8, zero) : _mm_unpacklo_epi8(y8, zero);
+            __m128i blue = _mm_sub_epi16(
+                half_ind ? _mm_unpackhi_epi8(cb8, zero) : _mm_unpacklo_epi8(cb8, zero), bias);
+            __m128i red = _mm_sub_epi16(
+                half_ind ? _mm_unpackhi_epi8(cr8, zero) : _mm_unpacklo_epi8(cr8, zero), bias);
+
+            out[0][half_ind] = Channel(y16, red, ones, red_k);
+            out[2][half_ind] = Channel(y16, blue, ones, blue_k);
+            __m128i lo = _mm_add_epi32(
+                _mm_madd_epi16(_mm_unpacklo_epi16(blue, red), green_k), half);
+            __m128i hi = _mm_add_epi32(
+                _mm_madd_epi16(_mm_unpackhi_epi16(blue, red), green_k), half);
+            out[1][half_ind] = _mm_add_epi16(
+                y16, _mm_packs_epi32(_mm_srai_epi32(lo, kScaleBits),
+                                     _mm_srai_epi32(hi, kScaleBits)));
+        }
+        for (int channel = 0; channel < 3; ++channel) {
+            _mm_store_si128(reinterpret_cast<__m128i*>(planes[channel]),
+                            _mm_packus_epi16(out[channel][0], out[channel][1]));
+        }
+        uint8_t* dst = rgb + channels * col;
+        for (int ind = 0; ind < 16; ++ind, dst += channels) {
+            dst[0] = planes[0][ind];
+            dst[1] = planes[1][ind];
+            dst[2] = planes[2][ind];
+            if (channels == 4) {
+                dst[3] = 255;
+            }
+        }
+    }
+    return col;
+}
+#endif
+}  // namespace
+
+const uint8_t* UpsampleRow(const PlaneView& plane, int hor_factor, int vert_factor, int row,
+                           Upsampling method, uint8_t* out, int out_width) {
+    int plane_row = std::min(row / vert_factor, plane.height - 1);
+    const uint8_t* cur = plane.Row(plane_row);
+
+    // the filter is only defined for h2v1, h1v2 and h2v2, the rest gets nearest
+    bool fancy = method == Upsampling::Fancy && hor_factor <= 2 && vert_factor <= 2 &&
+                 hor_factor * vert_factor > 1;
+    if (fancy && vert_factor == 2) {
+        // upper output row of the pair leans on the row above
+        bool upper = row % 2 == 0;
+        int near_row = upper ? std::max(plane_row - 1, 0)
+                             : std::min(plane_row + 1, plane.height - 1);
+        const uint8_t* near = plane.Row(near_row);
+        if (hor_factor == 2) {
+            UpsampleFancyH2V2(cur, near, plane.width, out);
+        } else {
+            UpsampleFancyV2(cur, near, upper ? 1 : 2, plane.width, out);
+        }
+    } else if (fancy) {
+        UpsampleFancyH2(cur, plane.width, out);
+    } else if (hor_factor != 1) {
+        UpsampleNearest(cur, hor_factor, out, out_width);
+    } else {
+        return cur;
+    }
+    return out;
+}
+
+void YCbCrToRgbRow(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, uint8_t* rgb,
+                   int width, int channels) {
+    int done = 0;
+#ifdef __SSE2__
+    done = YCbCrToRgbSse2(y, cb, cr, rgb, width, channels);
+#endif
+    YCbCrToRgbScalar(y + done, cb + done, cr + done, rgb + channels * done, width - done,
+                     channels);
+}
+
+void GrayToRgbRow(const uint8_t* gray, uint8_t* rgb, int width, int channels) {
+    for (int col = 0; col < width; ++col) {
+        uint8_t* dst = rgb + channels * col;
+        dst[0] = dst[1] = dst[2] = gray[col];
+        if (channels == 4) {
+            dst[3] = 255;
+        }
+    }
+}
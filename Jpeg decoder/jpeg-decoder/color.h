@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+
+enum class Upsampling {
+    Nearest,  // every chroma sample is repeated
+    Fancy     // triangle filter for 2x factors, like libjpeg does by default
+};
+
+// samples of one component, width and height are without MCU padding.
+// Only the last stored_rows rows may be kept, row r is then at r % stored_rows.
+struct PlaneView {
+    const uint8_t* data;
+    int stride;
+    int width, height;
+    int stored_rows;
+
+    const uint8_t* Row(int row) const {
+        return data + (row % stored_rows) * stride;
+    }
+};
+
+// Returns the samples of output row `row` of a plane subsampled by
+// hor_factor x vert_factor, out_width of them. Uses out (at least
+// hor_factor * plane.width bytes) as storage unless no work is needed.
+const uint8_t* UpsampleRow(const PlaneView& plane, int hor_factor, int vert_factor, int row,
+                           Upsampling method, uint8_t* out, int out_width);
+
+// JFIF YCbCr -> interleaved RGB, 14-bit fixed point. channels is 3 or 4,
+// the fourth one gets opaque alpha.
+void YCbCrToRgbRow(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, uint8_t* rgb,
+                   int width, int channels = 3);
+
+void GrayToRgbRow(const uint8_t* gray, uint8_t* rgb, int width, int channels = 3);
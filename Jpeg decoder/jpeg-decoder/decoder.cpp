@@ -1,9 +1,21 @@
 #include "decoder.h"
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <iterator>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include "channel.h"
+#include "color.h"
 #include "errors.h"
+#ifdef JPEG_DECODER_WITH_FFTW
 #include "fourier.h"
+#endif
+#include "idct.h"
+#include "mapped_file.h"
 #include "tricks.h"
 
 const std::unordered_map<int, SectionTitle> JpgDecoder::kSectionTitles = {
@@ -28,12 +40,66 @@ const std::unordered_map<int, SectionTitle> JpgDecoder::kSectionTitles = {
     {0xffc4, SectionTitle::DHT},
     {0xffdb, SectionTitle::DQT},
     {0xffc0, SectionTitle::SOF0},
+    {0xffc2, SectionTitle::SOF2},
     {0xffda, SectionTitle::SOS},
+    {0xffdd, SectionTitle::DRI},
     {0xffd9, SectionTitle::EOI}};
 
+// zigzag index -> natural index
+const int kZigzagToNatural[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+JpgDecoder::JpgDecoder(std::istream& in_stream, const DecoderOptions& options)
+    : options_(options),
+      context_(options.context ? options.context : &own_context_),
+      own_data_(std::istreambuf_iterator<char>(in_stream), std::istreambuf_iterator<char>()),
+      cur_(own_data_.data()),
+      end_(own_data_.data() + own_data_.size()) {}
+
+JpgDecoder::~JpgDecoder() {
+    for (auto & [ id, component ] : components_) {
+        context_->planes_[id] = std::move(component.matrix);
+        context_->coefs_[id] = std::move(component.coefs);
+    }
+}
+
+#ifdef JPEG_DECODER_WITH_FFTW
+// everything in FFTW but fftw_execute shares the planner state and isn't thread
+// safe, batch decoding has contexts on many threads
+static std::mutex planner_mutex;
+
+void DestroyFourierPlan(fftw_plan plan) {
+    std::lock_guard lock(planner_mutex);
+    fftw_destroy_plan(plan);
+}
+#endif
+
+bool DecoderContext::ImportFftwWisdom(const std::string& filename) {
+#ifdef JPEG_DECODER_WITH_FFTW
+    std::lock_guard lock(planner_mutex);
+    return fftw_import_wisdom_from_filename(filename.c_str()) != 0;
+#else
+    (void)filename;
+    return false;
+#endif
+}
+
+bool DecoderContext::ExportFftwWisdom(const std::string& filename) const {
+#ifdef JPEG_DECODER_WITH_FFTW
+    std::lock_guard lock(planner_mutex);
+    return fftw_export_wisdom_to_filename(filename.c_str()) != 0;
+#else
+    (void)filename;
+    return false;
+#endif
+}
+
 uint8_t JpgDecoder::ReadOne(int* len) {
-    Expect(in_stream_.peek() != EOF, "File suddenly ended");
-    uint8_t byte = in_stream_.get();
+    Expect(cur_ != end_, "File suddenly ended");
+    uint8_t byte = *cur_++;
     if (len) {
         --(*len);
     }
@@ -46,18 +112,22 @@ uint16_t JpgDecoder::ReadTwo(int* len) {
     return byte_pair;
 }
 
-Section JpgDecoder::NextSection() {
-    unsigned int code = in_stream_.get();
-    code = (code << 8) + in_stream_.peek();
+void JpgDecoder::Skip(int len) {
+    Expect(len <= end_ - cur_, "File suddenly ended");
+    cur_ += len;
+}
 
-    SectionTitle title;
-    try {
-        title = kSectionTitles.at(code);
-        in_stream_.get();
-    } catch (const std::out_of_range&) {
-        in_stream_.unget();
+Section JpgDecoder::NextSection() {
+    if (end_ - cur_ < 2) {
         return {SectionTitle::NOT_A_SECTION, 0};
     }
+    unsigned int code = (static_cast<unsigned int>(cur_[0]) << 8) + cur_[1];
+    auto found = kSectionTitles.find(code);
+    if (found == kSectionTitles.end()) {
+        return {SectionTitle::NOT_A_SECTION, 0};
+    }
+    cur_ += 2;
+    SectionTitle title = found->second;
 
     if (title == SectionTitle::SOI || title == SectionTitle::EOI) {
         return {title, 0};
@@ -67,16 +137,21 @@ Section JpgDecoder::NextSection() {
     return {title, len - 2};
 }
 
-void JpgDecoder::ProcessImage() {
+void JpgDecoder::ProcessImage(ScanlineSink* sink) {
+    sink_ = sink;
+    Expect(options_.scale == 1 || options_.scale == 2 || options_.scale == 4 ||
+               options_.scale == kBlockSize,
+           "Scale must be 1, 2, 4 or 8");
     Expect(NextSection().title == SectionTitle::SOI,
            "No SOI marker in the start of file");
 
-    Section section;
-    do {
-        section = NextSection();
+    // baseline has one scan right before EOI, progressive goes on
+    // scan after scan, tables may change in between
+    while (true) {
+        Section section = NextSection();
         switch (section.title) {
             case SectionTitle::APPn:
-                in_stream_.ignore(section.len);
+                Skip(section.len);
                 break;
             case SectionTitle::COM:
                 ParseCOM(section.len);
@@ -88,30 +163,99 @@ void JpgDecoder::ProcessImage() {
                 ParseDHT(section.len);
                 break;
             case SectionTitle::SOF0:
+            case SectionTitle::SOF2:
+                Expect(components_.empty(), "Duplicate of SOF section");
+                progressive_ = section.title == SectionTitle::SOF2;
                 ParseSOF0(section.len);
                 break;
+            case SectionTitle::DRI:
+                ParseDRI(section.len);
+                break;
             case SectionTitle::SOS:
                 ParseSOSHeader(section.len);
+                ValidCheck();
+                if (!progressive_) {
+                    ProcessSOS();
+                    Expect(NextSection().title == SectionTitle::EOI,
+                           "No EOI marker in the end of scan");
+                    return;
+                }
+                ProcessProgressiveScan();
+                if (options_.dc_preview && DcPreviewReady()) {
+                    MakeDcPreview();
+                    return;
+                }
                 break;
+            case SectionTitle::EOI:
+                Expect(progressive_ && scans_done_ > 0, "No scans in the file");
+                FinishProgressive();
+                return;
             default:
                 throw std::runtime_error("No section marker in expected place");
         }
-    } while (section.title != SectionTitle::SOS);
+    }
+}
 
-    ValidCheck();
+ImageInfo JpgDecoder::ProbeImage() {
+    Expect(NextSection().title == SectionTitle::SOI,
+           "No SOI marker in the start of file");
+    while (true) {
+        Section section = NextSection();
+        switch (section.title) {
+            case SectionTitle::COM:
+                ParseCOM(section.len);
+                break;
+            case SectionTitle::APPn:
+            case SectionTitle::DQT:
+            case SectionTitle::DHT:
+            case SectionTitle::DRI:
+                Skip(section.len);
+                break;
+            case SectionTitle::SOF0:
+            case SectionTitle::SOF2: {
+                ImageInfo info = ParseFrameHeader(section.len);
+                info.progressive = section.title == SectionTitle::SOF2;
+                info.comment = comment_;
+                return info;
+            }
+            default:
+                throw std::runtime_error("No SOF section before scans");
+        }
+    }
+}
 
-    ProcessSOS();
+void JpgDecoder::ParseCOM(int len) {
+    Expect(len <= end_ - cur_, "File suddenly ended");
+    comment_.append(reinterpret_cast<const char*>(cur_), len);
+    cur_ += len;
+}
 
-    Expect(NextSection().title == SectionTitle::EOI,
-           "No EOI marker in the end of scan");
+int Signed(int number, int declared_len) {
+    if (declared_len == 0) {
+        return 0;
+    }
+    if ((number >> (declared_len - 1)) == 0) {
+        number = -((~number) & ((1 << declared_len) - 1));
+    }
+    return number;
 }
 
-void JpgDecoder::ParseCOM(int len) {
-    while (len != 0) {
-        char buf = in_stream_.get();
-        --len;
-        comment_ += buf;
+std::vector<int> FastAcTable(const HuffmanDecoder& decoder) {
+    const int lookup_bits = HuffmanDecoder::kLookupBits;
+    std::vector<int> table(1 << lookup_bits);
+    for (int bits = 0; bits < (1 << lookup_bits); ++bits) {
+        auto [ac_code, code_len] = decoder.LookupSymbol(bits);
+        int zeros_before = ac_code >> 4;
+        int declared_len = ac_code & 0xf;
+        if (code_len == 0 || declared_len == 0 || code_len + declared_len > lookup_bits) {
+            continue;
+        }
+        int magnitude = (bits >> (lookup_bits - code_len - declared_len)) &
+                        ((1 << declared_len) - 1);
+        int value = Signed(magnitude, declared_len);
+        table[bits] = value * 256 + (zeros_before << 4) + code_len + declared_len;
     }
+    return table;
 }
 
 void JpgDecoder::ParseDHT(int len) {
@@ -132,7 +276,8 @@ void JpgDecoder::ParseDHT(int len) {
 
         int id = info_byte & 0xf;
         HuffmanTableInfo table_info{type, id};
-        Expect(huffman_decoders_.find(table_info) == huffman_decoders_.end(),
+        // progressive files redefine tables between scans
+        Expect(progressive_ || huffman_tables_.find(table_info) == huffman_tables_.end(),
                "Multiple definition of huffman table");
 
         std::vector<int> codes_number;
@@ -147,7 +292,27 @@ void JpgDecoder::ParseDHT(int len) {
         for (size_t ind = 0; ind < total_values; ++ind) {
             codes_values.push_back(ReadOne(&len));
         }
-        huffman_decoders_[table_info].BuildTree(codes_number, codes_values);
+
+        // most encoders write the same few tables, they are built only once
+        std::string key = type;
+        key.append(codes_number.begin(), codes_number.end());
+        key.append(codes_values.begin(), codes_values.end());
+        auto& cache = context_->huffman_tables_;
+        auto cached = cache.find(key);
+        if (cached != cache.end()) {
+            huffman_tables_[table_info] = cached->second;
+            continue;
+        }
+        auto table = std::make_shared<HuffmanTable>();
+        table->decoder.BuildTree(codes_number, codes_values);
+        if (type == "AC") {
+            table->fast_ac = FastAcTable(table->decoder);
+        }
+        if (cache.size() >= DecoderContext::kMaxHuffmanTables) {
+            cache.clear();
+        }
+        cache[key] = table;
+        huffman_tables_[table_info] = table;
     }
 }
 
@@ -169,104 +334,177 @@ void JpgDecoder::ParseDQT(int len) {
 
         int table_id = info_byte & 0xf;
 
-        std::vector<int> table_values;
+        std::vector<uint16_t> table_values;
         table_values.reserve(kBlockSize * kBlockSize);
         for (size_t ind = 0; ind < kBlockSize * kBlockSize; ++ind) {
-            int value = (values_len == 1) ? ReadOne(&len) : ReadTwo(&len);
+            uint16_t value = (values_len == 1) ? ReadOne(&len) : ReadTwo(&len);
             table_values.push_back(value);
         }
-        quantum_tables_[table_id] = ZigzagMatrix<int>(table_values, kBlockSize);
+        quantum_tables_[table_id] = ZigzagMatrix(table_values, kBlockSize);
     }
 }
 
-void JpgDecoder::ParseSOF0(int len) {
+void JpgDecoder::ParseDRI(int len) {
+    Expect(len == 2, "Not valid len of DRI section");
+    restart_interval_ = ReadTwo();
+}
+
+ImageInfo JpgDecoder::ParseFrameHeader(int len) {
+    ImageInfo info;
     // pass the precision, because it's
     // always 8 bit in baseline
     ReadOne(&len);
 
-    height_ = ReadTwo(&len);
-    width_ = ReadTwo(&len);
-    Expect(height_ > 0 && width_ > 0, "Image size is not valid");
+    info.height = ReadTwo(&len);
+    info.width = ReadTwo(&len);
+    Expect(info.height > 0 && info.width > 0, "Image size is not valid");
 
     int components_num = ReadOne(&len);
     Expect(components_num == 3 || components_num == 1,
            "Wrong number of components");
 
     while (len != 0) {
-        int component_id = ReadOne(&len);
-        Expect(component_id >= 1 && component_id <= 3, "Wrong component id");
-        Expect(components_.find(component_id) == components_.end(),
-               "Duplicate of component info");
+        ComponentInfo component;
+        component.id = ReadOne(&len);
+        Expect(component.id >= 1 && component.id <= 3, "Wrong component id");
+        for (const auto& other : info.components) {
+            Expect(other.id != component.id, "Duplicate of component info");
+        }
 
         uint8_t thin_byte = ReadOne(&len);
-        int hor_thin = thin_byte >> 4;
-        Expect(hor_thin == 1 || hor_thin == 2, "Not valid horizontal thinning");
-        max_hor_thin_ = std::max(max_hor_thin_, hor_thin);
-        int vert_thin = thin_byte & 0xf;
-        Expect(vert_thin == 1 || vert_thin == 2, "Not valid vertical thinning");
-        max_vert_thin_ = std::max(max_vert_thin_, vert_thin);
-        int quantum_table_id = ReadOne(&len);
-        components_[component_id] = {vert_thin, hor_thin, quantum_table_id};
+        component.hor_thin = thin_byte >> 4;
+        Expect(component.hor_thin == 1 || component.hor_thin == 2,
+               "Not valid horizontal thinning");
+        component.vert_thin = thin_byte & 0xf;
+        Expect(component.vert_thin == 1 || component.vert_thin == 2,
+               "Not valid vertical thinning");
+        component.quantum_table_id = ReadOne(&len);
+        info.components.push_back(component);
         --components_num;
         Expect(components_num >= 0, "Wrong declared len of SOF0 section");
     }
     Expect(!components_num, "Wrong components number");
+    return info;
+}
+
+void JpgDecoder::ParseSOF0(int len) {
+    ImageInfo info = ParseFrameHeader(len);
+    height_ = info.height;
+    width_ = info.width;
+    components_num_ = info.components.size();
+    for (const auto& info_component : info.components) {
+        max_hor_thin_ = std::max(max_hor_thin_, info_component.hor_thin);
+        max_vert_thin_ = std::max(max_vert_thin_, info_component.vert_thin);
+        auto& component = components_[info_component.id];
+        component = Component();
+        component.vert_thin = info_component.vert_thin;
+        component.hor_thin = info_component.hor_thin;
+        component.quantum_table_id = info_component.quantum_table_id;
+        // buffers of the previous image are reused
+        component.matrix = std::move(context_->planes_[info_component.id]);
+        component.coefs = std::move(context_->coefs_[info_component.id]);
+    }
+    SetupScaling(options_.scale, options_.crop);
 }
 
 void JpgDecoder::ParseSOSHeader(int len) {
-    components_num_ = ReadOne(&len);
-    Expect(components_num_ == components_.size(),
+    Expect(!components_.empty(), "No SOF section before SOS");
+    int scan_components_num = ReadOne(&len);
+    Expect(progressive_ ? scan_components_num >= 1 && scan_components_num <= components_num_
+                        : scan_components_num == components_num_,
            "Numbers of components doesn't match");
 
-    for (int ind = 0; ind < components_num_; ++ind) {
+    scan_components_.clear();
+    std::vector<std::pair<int, int>> table_ids;
+    for (int ind = 0; ind < scan_components_num; ++ind) {
         int component_id = ReadOne(&len);
         Expect(components_.find(component_id) != components_.end(),
                "Wrong component id in SOS section");
+        Expect(std::find(scan_components_.begin(), scan_components_.end(), component_id) ==
+                   scan_components_.end(),
+               "Duplicate component in SOS section");
+        scan_components_.push_back(component_id);
         uint8_t huffman_byte = ReadOne(&len);
-        int dc_id = huffman_byte >> 4;
-        Expect(huffman_decoders_.find({"DC", dc_id}) != huffman_decoders_.end(),
-               "Wrong DC huffman id in SOS section");
-        int ac_id = huffman_byte & 0xf;
-        Expect(huffman_decoders_.find({"AC", ac_id}) != huffman_decoders_.end(),
-               "Wrong AC huffman id in SOS section");
-        components_.at(component_id).huffman_ac = {"AC", ac_id};
-        components_.at(component_id).huffman_dc = {"DC", dc_id};
+        table_ids.emplace_back(huffman_byte >> 4, huffman_byte & 0xf);
     }
 
-    in_stream_.ignore(1);
-    Expect(ReadOne() == 0x3f, "Yeah, very funny");
-    in_stream_.ignore(1);
-    len -= 3;
+    spectral_start_ = ReadOne(&len);
+    spectral_end_ = ReadOne(&len);
+    uint8_t approximation = ReadOne(&len);
+    approximation_high_ = approximation >> 4;
+    approximation_low_ = approximation & 0xf;
     Expect(!len, "Not valid len of SOS section");
+    if (progressive_) {
+        Expect(spectral_start_ <= spectral_end_ && spectral_end_ < kBlockSize * kBlockSize,
+               "Not valid spectral selection");
+        Expect((spectral_start_ == 0) == (spectral_end_ == 0),
+               "DC and AC coefficients in one scan");
+        Expect(spectral_start_ == 0 || scan_components_num == 1,
+               "Interleaved AC scan");
+        Expect(approximation_low_ <= 13, "Not valid successive approximation");
+    } else {
+        Expect(spectral_end_ == 0x3f, "Yeah, very funny");
+    }
+
+    // progressive scans need only the tables they use
+    bool uses_dc = !progressive_ || (spectral_start_ == 0 && approximation_high_ == 0);
+    bool uses_ac = !progressive_ || spectral_start_ > 0;
+    for (int ind = 0; ind < scan_components_num; ++ind) {
+        auto& component = components_.at(scan_components_[ind]);
+        auto [dc_id, ac_id] = table_ids[ind];
+        Expect(!uses_dc || huffman_tables_.find({"DC", dc_id}) != huffman_tables_.end(),
+               "Wrong DC huffman id in SOS section");
+        Expect(!uses_ac || huffman_tables_.find({"AC", ac_id}) != huffman_tables_.end(),
+               "Wrong AC huffman id in SOS section");
+        component.huffman_ac = {"AC", ac_id};
+        component.huffman_dc = {"DC", dc_id};
+        component.dc_table = uses_dc ? huffman_tables_.at(component.huffman_dc).get() : nullptr;
+        component.ac_table = uses_ac ? huffman_tables_.at(component.huffman_ac).get() : nullptr;
+    }
 }
 
-int Signed(int number, int declared_len) {
-    if ((number >> (declared_len - 1)) == 0) {
-        number = -((~number) & ((1 << declared_len) - 1));
+void JpgDecoder::GetOneBlock(BitReader* reader, const Component& component,
+                             int* prev_dc_coef, uint8_t* out, int stride, DecoderStats* stats) {
+    int16_t coefs[kBlockSize * kBlockSize];
+    int last = DecodeBlock(reader, component, prev_dc_coef, coefs);
+    if (out) {
+        ReconstructBlock(coefs, last, component, out, stride, stats);
     }
-    return number;
 }
 
-Matrix<double> JpgDecoder::GetOneBlock(BitReader* reader,
-                                       const Component& component,
-                                       int* prev_dc_coef) {
-    std::vector<double> values(kBlockSize * kBlockSize);
+int JpgDecoder::DecodeBlock(BitReader* reader, const Component& component,
+                            int* prev_dc_coef, int16_t* coefs) {
+    // 16 bits are enough for any coefficient of 8-bit baseline data;
+    // coefficients go straight to their natural place
+    std::fill(coefs, coefs + kBlockSize * kBlockSize, 0);
 
     // first read adding to DC coefficient
-    auto& dc_huffman = huffman_decoders_.at(component.huffman_dc);
+    const auto& dc_huffman = component.dc_table->decoder;
     uint8_t dc_code = dc_huffman.DecodeSymbol(reader);
-    values[0] = *prev_dc_coef;
+    coefs[0] = *prev_dc_coef;
     if (dc_code != 0) {
         int declared_len = dc_code & 0xf;
-        int dc_add = Signed(reader->Get(declared_len), declared_len);
-        values[0] += dc_add;
-        *prev_dc_coef = values[0];
+        coefs[0] += Signed(reader->Get(declared_len), declared_len);
+        *prev_dc_coef = coefs[0];
     }
 
     // now goes AC coefficients
-    auto& ac_huffman = huffman_decoders_.at(component.huffman_ac);
-    int ind = 1;
+    const auto& ac_table = *component.ac_table;
+    const auto& ac_huffman = ac_table.decoder;
+    const auto& fast_ac = ac_table.fast_ac;
+    int ind = 1, last = 0;
     while (ind < kBlockSize * kBlockSize) {
+        int fast = fast_ac[reader->Peek(HuffmanDecoder::kLookupBits)];
+        if (fast != 0) {
+            // code and magnitude bits in one go
+            reader->Consume(fast & 0xf);
+            ind += (fast >> 4) & 0xf;
+            Expect(ind < kBlockSize * kBlockSize,
+                   "Too much coefficients for one block");
+            coefs[kZigzagToNatural[ind]] = fast >> 8;
+            last = ind++;
+            continue;
+        }
         uint8_t ac_code = ac_huffman.DecodeSymbol(reader);
         if (ac_code == 0) {
             break;
@@ -280,43 +518,193 @@ Matrix<double> JpgDecoder::GetOneBlock(BitReader* reader,
             Expect(ind < kBlockSize * kBlockSize,
                    "Too much coefficients for one block");
             int declared_len = ac_code & 0xf;
-            values[ind] = Signed(reader->Get(declared_len), declared_len);
-            ++ind;
+            coefs[kZigzagToNatural[ind]] = Signed(reader->Get(declared_len), declared_len);
+            last = ind++;
+        }
+    }
+    return last;
+}
+
+void JpgDecoder::SetupScaling(int scale, const std::optional<Rect>& crop_option) {
+    scale_ = scale;
+    int full_width = (width_ + scale - 1) / scale;
+    int full_height = (height_ + scale - 1) / scale;
+    // one sample per block is too coarse to be smoothed
+    upsampling_ = scale == kBlockSize ? Upsampling::Nearest : options_.upsampling;
+
+    Rect crop = crop_option.value_or(Rect{0, 0, full_width, full_height});
+    Expect(crop.x >= 0 && crop.y >= 0 && crop.width > 0 && crop.height > 0 &&
+               crop.width <= full_width - crop.x && crop.height <= full_height - crop.y,
+           "Crop is out of the image");
+    crop_x_ = crop.x;
+    crop_y_ = crop.y;
+    out_width_ = crop.width;
+    out_height_ = crop.height;
+
+    // fancy upsampling looks one chroma sample, i.e. two pixels, further
+    int mcu_width = kBlockSize * max_hor_thin_ / scale;
+    int mcu_height = kBlockSize * max_vert_thin_ / scale;
+    int margin = upsampling_ == Upsampling::Fancy ? 2 : 0;
+    first_mcu_col_ = std::max(crop_x_ - margin, 0) / mcu_width;
+    last_mcu_col_ =
+        (std::min(crop_x_ + out_width_ + margin, full_width) + mcu_width - 1) / mcu_width;
+    first_mcu_row_ = std::max(crop_y_ - margin, 0) / mcu_height;
+    last_mcu_row_ =
+        (std::min(crop_y_ + out_height_ + margin, full_height) + mcu_height - 1) / mcu_height;
+
+    // subsampled chroma is scaled up by a larger transform rather than by
+    // upsampling when the sizes allow it, the way libjpeg does
+    int min_size = kBlockSize / scale;
+    for (auto & [ id, component ] : components_) {
+        int size = min_size;
+        while (size < kBlockSize &&
+               (max_hor_thin_ * min_size) % (component.hor_thin * size * 2) == 0 &&
+               (max_vert_thin_ * min_size) % (component.vert_thin * size * 2) == 0) {
+            size *= 2;
         }
+        component.block_size = size;
+        component.hor_factor = max_hor_thin_ * min_size / (component.hor_thin * size);
+        component.vert_factor = max_vert_thin_ * min_size / (component.vert_thin * size);
+    }
+}
+
+void JpgDecoder::PrepareReconstruction() {
+#ifdef JPEG_DECODER_WITH_FFTW
+    if (options_.idct_method == IdctMethod::Fftw) {
+        CreateFourierPlan();
+    }
+#else
+    Expect(options_.idct_method != IdctMethod::Fftw, "Decoder is built without FFTW");
+#endif
+    SimdLevel level = options_.simd_level.value_or(BestSimdLevel());
+    idct_ = GetIdct(level);
+    low_frequency_idct_ = GetLowFrequencyIdct(level);
+    for (auto & [ id, component ] : components_) {
+        auto found = quantum_tables_.find(component.quantum_table_id);
+        Expect(found != quantum_tables_.end(), "Wrong quantum table id");
+        component.quantum_table = &found->second;
+    }
+}
+
+// zigzag indices up to this one are all in the top left 4x4 corner, the next
+// one is (4, 0)
+const int kLastLowFrequency = 9;
+
+void JpgDecoder::ReconstructBlock(const int16_t* coefs, int last, const Component& component,
+                                  uint8_t* out, int stride, DecoderStats* stats) {
+    const auto& quantum_table = *component.quantum_table;
+    if (last == 0) {
+        ++stats->dc_only_blocks;
+    } else if (last <= kLastLowFrequency) {
+        ++stats->low_frequency_blocks;
+    } else {
+        ++stats->full_blocks;
+    }
+    if (component.block_size < kBlockSize) {
+        GetScaledIdct(component.block_size)(coefs, &quantum_table(0, 0), out, stride);
+        return;
+    }
+
+#ifdef JPEG_DECODER_WITH_FFTW
+    if (options_.idct_method == IdctMethod::Fftw) {
+        auto samples = FftwBlock(coefs, quantum_table);
+        for (int row = 0; row < kBlockSize; ++row) {
+            for (int col = 0; col < kBlockSize; ++col) {
+                out[row * stride + col] =
+                    std::clamp<long>(std::lround(samples(row, col)) + 128, 0, 255);
+            }
+        }
+        return;
+    }
+#endif
+
+    if (last == 0) {
+        IdctDcOnly(coefs, &quantum_table(0, 0), out, stride);
+    } else if (last <= kLastLowFrequency) {
+        low_frequency_idct_(coefs, &quantum_table(0, 0), out, stride);
+    } else {
+        idct_(coefs, &quantum_table(0, 0), out, stride);
     }
+}
 
-    // zig-zag
-    Matrix<double> block = ZigzagMatrix(values, kBlockSize);
+void JpgDecoder::AddStats(const DecoderStats& stats) {
+    if (!options_.stats) {
+        return;
+    }
+    std::lock_guard lock(stats_mutex_);
+    options_.stats->dc_only_blocks += stats.dc_only_blocks;
+    options_.stats->low_frequency_blocks += stats.low_frequency_blocks;
+    options_.stats->full_blocks += stats.full_blocks;
+}
+
+#ifdef JPEG_DECODER_WITH_FFTW
+Matrix<double> JpgDecoder::FftwBlock(const int16_t* coefs,
+                                     const Matrix<uint16_t>& quantum_table) {
+    Matrix<double> block(kBlockSize, kBlockSize);
+    std::copy(coefs, coefs + kBlockSize * kBlockSize, &block(0, 0));
 
     // quantum
-    ElemMultiply<double>(&block,
-                         quantum_tables_.at(component.quantum_table_id));
+    ElemMultiply<double>(&block, quantum_table);
 
     // fourier
-    return DCT(block, fourier_plan_.get(), in_buffer_.get(), out_buffer_.get());
+    return DCT(block, context_->fourier_plan_.get(), context_->in_buffer_.get(),
+               context_->out_buffer_.get());
 }
+#endif
 
 void JpgDecoder::ValidCheck() const {
-    for (const auto & [ id, component ] : components_) {
-        Expect(quantum_tables_.find(component.quantum_table_id) !=
+    for (int id : scan_components_) {
+        Expect(quantum_tables_.find(components_.at(id).quantum_table_id) !=
                    quantum_tables_.end(),
                "Wrong quantum table id");
-        Expect(huffman_decoders_.find(component.huffman_dc) !=
-                       huffman_decoders_.end() &&
-                   huffman_decoders_.find(component.huffman_ac) !=
-                       huffman_decoders_.end(),
-               "Wrong huffman table info");
     }
 }
 
+#ifdef JPEG_DECODER_WITH_FFTW
 void JpgDecoder::CreateFourierPlan() {
+    // the plan doesn't depend on the image, a context makes it only once
+    if (context_->fourier_plan_) {
+        return;
+    }
+    std::lock_guard lock(planner_mutex);
     size_t buffer_size = kBlockSize * kBlockSize * sizeof(double);
-    in_buffer_.reset((double*)fftw_malloc(buffer_size));
-    out_buffer_.reset((double*)fftw_malloc(buffer_size));
+    context_->in_buffer_.reset((double*)fftw_malloc(buffer_size));
+    context_->out_buffer_.reset((double*)fftw_malloc(buffer_size));
     auto kind = FFTW_REDFT01;
-    fourier_plan_.reset(fftw_plan_r2r_2d(kBlockSize, kBlockSize,
-                                         in_buffer_.get(), out_buffer_.get(),
-                                         kind, kind, FFTW_MEASURE));
+    context_->fourier_plan_.reset(fftw_plan_r2r_2d(kBlockSize, kBlockSize,
+                                                   context_->in_buffer_.get(),
+                                                   context_->out_buffer_.get(), kind, kind,
+                                                   FFTW_MEASURE));
+}
+#endif
+
+void JpgDecoder::FindScanSegments(std::vector<ScanSegment>* segments) const {
+    // entropy-coded data goes until a marker, i.e. 0xff not followed by 0x00,
+    // RSTn markers only split it into restart intervals
+    segments->clear();
+    const uint8_t* begin = cur_;
+    const uint8_t* pos = cur_;
+    while (true) {
+        pos = static_cast<const uint8_t*>(std::memchr(pos, 0xff, end_ - pos));
+        if (!pos || pos + 1 == end_) {
+            segments->push_back({begin, pos ? pos : end_});
+            return;
+        }
+        uint8_t code = pos[1];
+        if (code == 0x00 || code == 0xff) {
+            // stuffed byte or fill before a marker
+            pos += code == 0x00 ? 2 : 1;
+            continue;
+        }
+        segments->push_back({begin, pos});
+        if (restart_interval_ == 0 || code < 0xd0 || code > 0xd7) {
+            return;
+        }
+        Expect(code - 0xd0 == static_cast<int>(segments->size() - 1) % 8,
+               "Restart markers are out of order");
+        pos += 2;
+        begin = pos;
+    }
 }
 
 int IncreaseToDivisible(int what, int by) {
@@ -326,106 +714,705 @@ int IncreaseToDivisible(int what, int by) {
     return what;
 }
 
-struct Corner {
-    int row = 0;
-    int col = 0;
-};
-
 void JpgDecoder::ProcessSOS() {
     int mcu_width = kBlockSize * max_hor_thin_;
     int mcu_height = kBlockSize * max_vert_thin_;
     int width_ext = IncreaseToDivisible(width_, mcu_width);
     int height_ext = IncreaseToDivisible(height_, mcu_height);
 
-    int mcu_per_row = width_ext / mcu_width;
+    mcu_per_row_ = width_ext / mcu_width;
     int mcu_per_col = height_ext / mcu_height;
+    int mcu_total = mcu_per_row_ * mcu_per_col;
+
+    PrepareReconstruction();
+
+    // restart intervals are independent, so they can go on several threads;
+    // fftw buffers are shared and keep it serial
+    auto& segments = context_->segments_;
+    FindScanSegments(&segments);
+    int interval = restart_interval_ ? restart_interval_ : mcu_total;
+    int segments_num = (mcu_total + interval - 1) / interval;
+    Expect(static_cast<int>(segments.size()) >= segments_num, "Too few restart intervals");
+
+    // restart intervals without a single MCU of the crop are not decoded at all
+    auto& needed = context_->needed_segments_;
+    needed.assign(segments_num, false);
+    int needed_num = 0;
+    for (int ind = 0; ind < segments_num; ++ind) {
+        for (int mcu = ind * interval; mcu < std::min((ind + 1) * interval, mcu_total); ++mcu) {
+            if (McuNeeded(mcu)) {
+                needed[ind] = true;
+                ++needed_num;
+                break;
+            }
+        }
+    }
+    // several restart intervals go to threads whole; a single one still has
+    // its reconstruction run on workers alongside the entropy decoding
+    int threads = options_.threads ? options_.threads : std::thread::hardware_concurrency();
+    bool can_thread = threads > 1 && options_.idct_method != IdctMethod::Fftw;
+    bool parallel = can_thread && needed_num > 1;
+    bool pipelined = can_thread && !parallel;
+    if (parallel) {
+        threads = std::min(threads, needed_num);
+    }
+    int workers = threads - 1;
+    // MCU rows of coefficients: being decoded, queued or being transformed
+    int slots_num = 2 * workers + 1;
 
-    // create 1 or 3 matrices for components
+    // serial decoding keeps two MCU rows of samples: the one being decoded and
+    // the previous one, which fancy upsampling may still need; pipelined
+    // adds the ones its slots may fill before those are out; parallel needs
+    // all the rows of the crop. All of them only keep the columns of the crop
     for (auto & [ id, component ] : components_) {
-        int cur_width = width_ext * component.hor_thin / max_hor_thin_;
-        int cur_height = height_ext * component.vert_thin / max_vert_thin_;
-        component.matrix.Resize(cur_height, cur_width);
+        int rows = parallel ? last_mcu_row_ - first_mcu_row_ : pipelined ? slots_num + 2 : 2;
+        component.matrix.Resize(
+            rows * component.block_size * component.vert_thin,
+            (last_mcu_col_ - first_mcu_col_) * component.hor_thin * component.block_size);
     }
+    StartOutput();
 
-    // create fourier plan
-    CreateFourierPlan();
+    if (parallel) {
+        std::atomic<int> next_segment = 0;
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto work = [&] {
+            try {
+                for (int ind = next_segment++; ind < segments_num; ind = next_segment++) {
+                    if (needed[ind]) {
+                        DecodeSegment(segments[ind], ind * interval,
+                                      std::min((ind + 1) * interval, mcu_total), false);
+                    }
+                }
+            } catch (...) {
+                std::lock_guard lock(error_mutex);
+                error = std::current_exception();
+                next_segment = segments_num;
+            }
+        };
+        std::vector<std::thread> workers;
+        for (int ind = 1; ind < threads; ++ind) {
+            workers.emplace_back(work);
+        }
+        work();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        EmitRows(crop_y_ + out_height_);
+    } else if (pipelined) {
+        DecodePipelined(segments, needed, interval, mcu_total, workers, slots_num);
+    } else {
+        for (int ind = 0; ind < segments_num; ++ind) {
+            int last_mcu = std::min((ind + 1) * interval, mcu_total);
+            if (needed[ind]) {
+                DecodeSegment(segments[ind], ind * interval, last_mcu, true);
+            } else {
+                EmitMcuRows(last_mcu / mcu_per_row_);
+            }
+        }
+    }
+    cur_ = segments.back().end;
+}
 
-    // now start scan
-    BitReader reader(in_stream_);
-    reader.SetSkipRule(0xff, 0x00);
+void JpgDecoder::DecodePipelined(const std::vector<ScanSegment>& segments,
+                                 const std::vector<bool>& needed, int interval, int mcu_total,
+                                 int workers, int slots_num) {
+    int mcu_blocks = 0;
+    for (const auto & [ id, component ] : components_) {
+        mcu_blocks += component.hor_thin * component.vert_thin;
+    }
+    size_t row_size = static_cast<size_t>(last_mcu_col_ - first_mcu_col_) * mcu_blocks *
+                      kBlockSize * kBlockSize;
+    auto& slots = context_->coef_rows_;
+    auto& slot_ends = context_->coef_row_ends_;
+    slots.resize(slots_num);
+    slot_ends.resize(slots_num);
+    for (int slot = 0; slot < slots_num; ++slot) {
+        slots[slot].resize(row_size);
+        slot_ends[slot].resize(row_size / (kBlockSize * kBlockSize));
+    }
+    Channel<int> free_slots(slots_num);
+    for (int slot = 0; slot < slots_num; ++slot) {
+        free_slots.push(slot);
+    }
+    // MCU row and the slot with its coefficients
+    Channel<std::pair<int, int>> ready(slots_num);
+
+    const auto& luma = components_.at(1);
+    int ring = luma.matrix.Rows() / (luma.vert_thin * luma.block_size);
+    std::mutex state_mutex;
+    std::condition_variable emitted_cv;
+    std::vector<bool> done(last_mcu_row_ - first_mcu_row_);
+    int next_emit = first_mcu_row_;
+    bool emitting = false, stopped = false;
+    std::exception_ptr error;
+    auto fail = [&](std::exception_ptr error_ptr) {
+        {
+            std::lock_guard lock(state_mutex);
+            if (!error) {
+                error = error_ptr;
+            }
+            stopped = true;
+        }
+        emitted_cv.notify_all();
+        free_slots.close();
+        ready.close();
+    };
+
+    auto work = [&] {
+        try {
+            while (auto item = ready.pop()) {
+                auto [ mcu_row, slot ] = *item;
+                {
+                    // the ring rows it goes to must be out already
+                    std::unique_lock lock(state_mutex);
+                    emitted_cv.wait(lock,
+                                    [&] { return stopped || next_emit >= mcu_row - ring + 2; });
+                    if (stopped) {
+                        return;
+                    }
+                }
+                ReconstructMcuRow(slots[slot].data(), slot_ends[slot].data(), mcu_row);
+                free_slots.push(slot);
 
-    // last dc coef to remember for each component
-    std::vector<int> last_dc(components_num_);
-    std::vector<Corner> start_corners(components_num_);
-
-    // you don't have to understand it
-    for (int mcu_row = 0; mcu_row < mcu_per_col; ++mcu_row) {
-        for (auto& corner : start_corners) {
-            corner.col = 0;
-        }
-        for (int mcu_col = 0; mcu_col < mcu_per_row; ++mcu_col) {
-            for (int comp_id = 1; comp_id <= components_num_; ++comp_id) {
-                auto& cur_component = components_.at(comp_id);
-                auto& cur_corner = start_corners[comp_id - 1];
-                int row_shift = 0, col_shift = 0;
-                for (int magic_var :
-                     {2, cur_component.hor_thin, cur_component.vert_thin,
-                      cur_component.hor_thin * cur_component.vert_thin / 2}) {
-                    if (magic_var == 2) {
-                        auto block = GetOneBlock(&reader, cur_component,
-                                                 &last_dc[comp_id - 1]);
-                        PutIn<double>(block, &cur_component.matrix,
-                                      cur_corner.row + row_shift,
-                                      cur_corner.col + col_shift);
+                // rows go out in order, whoever finds the next one ready
+                // converts it while the others go on transforming
+                std::unique_lock lock(state_mutex);
+                done[mcu_row - first_mcu_row_] = true;
+                if (emitting) {
+                    continue;
+                }
+                emitting = true;
+                while (!stopped && next_emit < last_mcu_row_ &&
+                       done[next_emit - first_mcu_row_]) {
+                    lock.unlock();
+                    EmitMcuRows(next_emit + 1);
+                    lock.lock();
+                    ++next_emit;
+                    emitted_cv.notify_all();
+                }
+                emitting = false;
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int ind = 0; ind < workers; ++ind) {
+        threads.emplace_back(work);
+    }
+
+    auto decode = [&] {
+        int16_t skipped[kBlockSize * kBlockSize];
+        int slot = -1, slot_row = -1;
+        for (size_t ind = 0; ind < needed.size(); ++ind) {
+            if (!needed[ind]) {
+                continue;
+            }
+            BitReader reader(segments[ind].begin, segments[ind].end);
+            reader.SetSkipRule(0xff, 0x00);
+            int last_dc[kMaxComponents] = {};
+            int last_mcu = std::min(static_cast<int>(ind + 1) * interval, mcu_total);
+            for (int mcu = ind * interval; mcu < last_mcu; ++mcu) {
+                int mcu_row = mcu / mcu_per_row_;
+                if (mcu_row >= last_mcu_row_) {
+                    break;
+                }
+                bool keep = McuNeeded(mcu);
+                if (keep && mcu_row != slot_row) {
+                    if (slot >= 0 && !ready.push({slot_row, slot})) {
+                        return;
+                    }
+                    auto free_slot = free_slots.pop();
+                    if (!free_slot) {
+                        return;
+                    }
+                    slot = *free_slot;
+                    slot_row = mcu_row;
+                }
+                int16_t* coefs = skipped;
+                uint8_t* ends = nullptr;
+                if (keep) {
+                    size_t first_block =
+                        static_cast<size_t>(mcu % mcu_per_row_ - first_mcu_col_) * mcu_blocks;
+                    coefs = slots[slot].data() + first_block * kBlockSize * kBlockSize;
+                    ends = slot_ends[slot].data() + first_block;
+                }
+                for (int comp_id = 1; comp_id <= components_num_; ++comp_id) {
+                    const auto& component = components_.at(comp_id);
+                    for (int block = 0; block < component.hor_thin * component.vert_thin;
+                         ++block) {
+                        int last = DecodeBlock(&reader, component, &last_dc[comp_id - 1], coefs);
+                        if (keep) {
+                            *ends++ = last;
+                            coefs += kBlockSize * kBlockSize;
+                        }
                     }
-                    col_shift = (col_shift + kBlockSize) % (2 * kBlockSize);
-                    row_shift = std::max(kBlockSize - col_shift, row_shift);
                 }
-                cur_corner.col += kBlockSize * cur_component.hor_thin;
             }
         }
+        if (slot >= 0) {
+            ready.push({slot_row, slot});
+        }
+    };
+    try {
+        decode();
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    ready.close();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void JpgDecoder::ReconstructMcuRow(const int16_t* coefs, const uint8_t* ends, int mcu_row) {
+    DecoderStats stats;
+    for (int mcu_col = first_mcu_col_; mcu_col < last_mcu_col_; ++mcu_col) {
+        for (int comp_id = 1; comp_id <= components_num_; ++comp_id) {
+            auto& component = components_.at(comp_id);
+            auto& plane = component.matrix;
+            int size = component.block_size;
+            int corner_row = (mcu_row * component.vert_thin * size) % plane.Rows();
+            int corner_col = (mcu_col - first_mcu_col_) * component.hor_thin * size;
+            for (int block_row = 0; block_row < component.vert_thin; ++block_row) {
+                for (int block_col = 0; block_col < component.hor_thin; ++block_col) {
+                    ReconstructBlock(coefs, *ends++, component,
+                                     &plane(corner_row + block_row * size,
+                                            corner_col + block_col * size),
+                                     plane.Columns(), &stats);
+                    coefs += kBlockSize * kBlockSize;
+                }
+            }
+        }
+    }
+    AddStats(stats);
+}
+
+bool JpgDecoder::McuNeeded(int mcu) const {
+    int mcu_row = mcu / mcu_per_row_;
+    int mcu_col = mcu % mcu_per_row_;
+    return mcu_row >= first_mcu_row_ && mcu_row < last_mcu_row_ && mcu_col >= first_mcu_col_ &&
+           mcu_col < last_mcu_col_;
+}
+
+void JpgDecoder::DecodeSegment(const ScanSegment& segment, int first_mcu, int last_mcu,
+                               bool emit) {
+    BitReader reader(segment.begin, segment.end);
+    reader.SetSkipRule(0xff, 0x00);
+
+    // dc predictions start from zero in every restart interval
+    int last_dc[kMaxComponents] = {};
+    DecoderStats stats;
+    for (int mcu = first_mcu; mcu < last_mcu; ++mcu) {
+        int mcu_row = mcu / mcu_per_row_;
+        int mcu_col = mcu % mcu_per_row_;
+        if (mcu_row >= last_mcu_row_) {
+            break;  // nothing below is in the crop
+        }
+        bool needed = McuNeeded(mcu);
         for (int comp_id = 1; comp_id <= components_num_; ++comp_id) {
-            start_corners[comp_id - 1].row +=
-                components_.at(comp_id).vert_thin * kBlockSize;
+            auto& component = components_.at(comp_id);
+            auto& plane = component.matrix;
+            int size = component.block_size;
+            int corner_row = (mcu_row * component.vert_thin * size) % plane.Rows();
+            int corner_col = (mcu_col - first_mcu_col_) * component.hor_thin * size;
+            for (int block_row = 0; block_row < component.vert_thin; ++block_row) {
+                for (int block_col = 0; block_col < component.hor_thin; ++block_col) {
+                    uint8_t* out = needed ? &plane(corner_row + block_row * size,
+                                                   corner_col + block_col * size)
+                                          : nullptr;
+                    GetOneBlock(&reader, component, &last_dc[comp_id - 1], out,
+                                plane.Columns(), &stats);
+                }
+            }
+        }
+        if (emit && mcu_col + 1 == mcu_per_row_) {
+            EmitMcuRows(mcu_row + 1);
         }
     }
+    AddStats(stats);
 }
 
-int Bound(int number) { return std::min(std::max(0, number), 255); }
+void JpgDecoder::EmitMcuRows(int mcu_rows) {
+    // the last row of an MCU row has to wait for the next one when chroma is
+    // smoothed vertically
+    int lag = 0;
+    for (const auto & [ id, component ] : components_) {
+        if (upsampling_ == Upsampling::Fancy && component.vert_factor > 1) {
+            lag = 1;
+        }
+    }
+    int end_row = mcu_rows * kBlockSize * max_vert_thin_ / scale_;
+    bool last = end_row >= (height_ + scale_ - 1) / scale_;
+    EmitRows(std::min(end_row - (last ? 0 : lag), crop_y_ + out_height_));
+}
+
+void JpgDecoder::ProcessProgressiveScan() {
+    int mcu_width = kBlockSize * max_hor_thin_;
+    int mcu_height = kBlockSize * max_vert_thin_;
+    mcu_per_row_ = IncreaseToDivisible(width_, mcu_width) / mcu_width;
+    int mcu_per_col = IncreaseToDivisible(height_, mcu_height) / mcu_height;
+
+    // coefficients of the whole image are refined scan after scan
+    if (scans_done_ == 0) {
+        for (auto & [ id, component ] : components_) {
+            component.blocks_per_line = mcu_per_row_ * component.hor_thin;
+            component.coefs.assign(static_cast<size_t>(component.blocks_per_line) * mcu_per_col *
+                                       component.vert_thin * kBlockSize * kBlockSize,
+                                   0);
+        }
+    }
+
+    // a scan of one component goes over its own blocks, not over MCUs
+    bool interleaved = scan_components_.size() > 1;
+    int units_per_line = mcu_per_row_, units_total = mcu_per_row_ * mcu_per_col;
+    if (!interleaved) {
+        const auto& component = components_.at(scan_components_[0]);
+        int hor_factor = max_hor_thin_ / component.hor_thin;
+        int vert_factor = max_vert_thin_ / component.vert_thin;
+        units_per_line = ((width_ + hor_factor - 1) / hor_factor + kBlockSize - 1) / kBlockSize;
+        int lines = ((height_ + vert_factor - 1) / vert_factor + kBlockSize - 1) / kBlockSize;
+        units_total = units_per_line * lines;
+    }
+
+    auto& segments = context_->segments_;
+    FindScanSegments(&segments);
+    int interval = restart_interval_ ? restart_interval_ : units_total;
+    int segments_num = (units_total + interval - 1) / interval;
+    Expect(static_cast<int>(segments.size()) >= segments_num, "Too few restart intervals");
 
-RGB ToRGB(double y_component, double cb_component, double cr_component) {
-    return {Bound(y_component + 1.402 * cr_component + 128),
-            Bound(y_component - 0.34414 * cb_component -
-                  0.71414 * cr_component + 128),
-            Bound(y_component + 1.772 * cb_component + 128)};
+    for (int segment = 0; segment < segments_num; ++segment) {
+        BitReader reader(segments[segment].begin, segments[segment].end);
+        reader.SetSkipRule(0xff, 0x00);
+        int last_dc[kMaxComponents] = {};
+        int eob_run = 0;
+        int last_unit = std::min((segment + 1) * interval, units_total);
+        for (int unit = segment * interval; unit < last_unit; ++unit) {
+            int unit_row = unit / units_per_line;
+            int unit_col = unit % units_per_line;
+            for (size_t ind = 0; ind < scan_components_.size(); ++ind) {
+                auto& component = components_.at(scan_components_[ind]);
+                int vert_blocks = interleaved ? component.vert_thin : 1;
+                int hor_blocks = interleaved ? component.hor_thin : 1;
+                for (int block_row = 0; block_row < vert_blocks; ++block_row) {
+                    for (int block_col = 0; block_col < hor_blocks; ++block_col) {
+                        int row = unit_row * vert_blocks + block_row;
+                        int col = unit_col * hor_blocks + block_col;
+                        int16_t* coefs =
+                            &component.coefs[(static_cast<size_t>(row) * component.blocks_per_line +
+                                              col) *
+                                             kBlockSize * kBlockSize];
+                        DecodeProgressiveBlock(&reader, component, coefs, &last_dc[ind],
+                                               &eob_run);
+                    }
+                }
+            }
+        }
+    }
+    cur_ = segments.back().end;
+
+    if (spectral_start_ == 0 && approximation_high_ == 0) {
+        for (int id : scan_components_) {
+            components_.at(id).has_dc = true;
+        }
+    }
+    ++scans_done_;
 }
 
-RGB ToRGB(double y_component) { return ToRGB(y_component, 0, 0); }
+void JpgDecoder::DecodeProgressiveBlock(BitReader* reader, const Component& component,
+                                        int16_t* coefs, int* prev_dc_coef, int* eob_run) {
+    int bit = 1 << approximation_low_;
 
-Image JpgDecoder::RGBImage() const {
-    Image image(width_, height_);
-    for (int row = 0; row < height_; ++row) {
-        for (int col = 0; col < width_; ++col) {
-            RGB pixel;
-            if (components_num_ == 1) {
-                pixel = ToRGB(components_.at(1).matrix(row, col));
-            } else {
-                pixel = ToRGB(components_.at(1).matrix(row, col),
-                              components_.at(2).matrix(row / max_vert_thin_,
-                                                       col / max_hor_thin_),
-                              components_.at(3).matrix(row / max_vert_thin_,
-                                                       col / max_hor_thin_));
+    if (spectral_start_ == 0) {
+        if (approximation_high_ == 0) {
+            uint8_t dc_code = component.dc_table->decoder.DecodeSymbol(reader);
+            Expect(dc_code <= 15, "Not valid DC coefficient length");
+            if (dc_code != 0) {
+                *prev_dc_coef += Signed(reader->Get(dc_code), dc_code);
+            }
+            coefs[0] = *prev_dc_coef * bit;
+        } else if (reader->Get(1)) {
+            coefs[0] |= bit;
+        }
+        return;
+    }
+
+    const auto& ac_huffman = component.ac_table->decoder;
+    int ind = spectral_start_;
+
+    if (approximation_high_ == 0) {
+        // first pass of a band: like baseline, but with runs of empty blocks
+        if (*eob_run > 0) {
+            --*eob_run;
+            return;
+        }
+        for (; ind <= spectral_end_; ++ind) {
+            uint8_t ac_code = ac_huffman.DecodeSymbol(reader);
+            int run = ac_code >> 4;
+            int len = ac_code & 0xf;
+            if (len == 0) {
+                if (run < 15) {
+                    *eob_run = (1 << run) - 1 + (run ? reader->Get(run) : 0);
+                    break;
+                }
+                ind += 15;
+                continue;
+            }
+            ind += run;
+            Expect(ind <= spectral_end_, "Too much coefficients for one block");
+            coefs[kZigzagToNatural[ind]] = Signed(reader->Get(len), len) * bit;
+        }
+        return;
+    }
+
+    // refinement: one more bit for every coefficient that is already
+    // nonzero, new ones can only be +-bit
+    auto refine = [&](int16_t* coef) {
+        if (reader->Get(1) && (*coef & bit) == 0) {
+            *coef += *coef >= 0 ? bit : -bit;
+        }
+    };
+    if (*eob_run == 0) {
+        for (; ind <= spectral_end_; ++ind) {
+            uint8_t ac_code = ac_huffman.DecodeSymbol(reader);
+            int run = ac_code >> 4;
+            int len = ac_code & 0xf;
+            int value = 0;
+            if (len != 0) {
+                Expect(len == 1, "Not valid refinement coefficient");
+                value = reader->Get(1) ? bit : -bit;
+            } else if (run != 15) {
+                *eob_run = (1 << run) + (run ? reader->Get(run) : 0);
+                break;
+            }
+            // skip run zero coefficients, refining the nonzero ones on the way
+            for (; ind <= spectral_end_; ++ind) {
+                int16_t* coef = &coefs[kZigzagToNatural[ind]];
+                if (*coef != 0) {
+                    refine(coef);
+                } else if (run-- == 0) {
+                    break;
+                }
+            }
+            if (value != 0) {
+                Expect(ind <= spectral_end_, "Too much coefficients for one block");
+                coefs[kZigzagToNatural[ind]] = value;
+            }
+        }
+    }
+    if (*eob_run > 0) {
+        for (; ind <= spectral_end_; ++ind) {
+            int16_t* coef = &coefs[kZigzagToNatural[ind]];
+            if (*coef != 0) {
+                refine(coef);
+            }
+        }
+        --*eob_run;
+    }
+}
+
+// progressive scans only leave coefficients, so the end is found afterwards
+int LastNonZero(const int16_t* coefs) {
+    int last = JpgDecoder::kBlockSize * JpgDecoder::kBlockSize - 1;
+    while (last > 0 && coefs[kZigzagToNatural[last]] == 0) {
+        --last;
+    }
+    return last;
+}
+
+void JpgDecoder::FinishProgressive() {
+    PrepareReconstruction();
+    DecoderStats stats;
+    for (auto & [ id, component ] : components_) {
+        int blocks_per_column =
+            component.coefs.size() / (component.blocks_per_line * kBlockSize * kBlockSize);
+        // only the blocks of the crop
+        int first_row = first_mcu_row_ * component.vert_thin;
+        int last_row = std::min(last_mcu_row_ * component.vert_thin, blocks_per_column);
+        int first_col = first_mcu_col_ * component.hor_thin;
+        int last_col = std::min(last_mcu_col_ * component.hor_thin, component.blocks_per_line);
+        auto& plane = component.matrix;
+        int size = component.block_size;
+        plane.Resize((last_row - first_row) * size, (last_col - first_col) * size);
+        for (int row = first_row; row < last_row; ++row) {
+            for (int col = first_col; col < last_col; ++col) {
+                const int16_t* coefs =
+                    &component.coefs[(static_cast<size_t>(row) * component.blocks_per_line + col) *
+                                     kBlockSize * kBlockSize];
+                ReconstructBlock(coefs, LastNonZero(coefs), component,
+                                 &plane((row * size) % plane.Rows(), (col - first_col) * size),
+                                 plane.Columns(), &stats);
             }
-            image.SetPixel(row, col, pixel);
         }
     }
-    image.SetComment(comment_);
-    return image;
+    AddStats(stats);
+    StartOutput();
+    EmitRows(crop_y_ + out_height_);
+}
+
+bool JpgDecoder::DcPreviewReady() const {
+    for (const auto & [ id, component ] : components_) {
+        if (!component.has_dc) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void JpgDecoder::MakeDcPreview() {
+    // only DC is there yet, so 1/8 scale loses nothing: every block gives
+    // its mean. The crop was given at options_.scale, the preview covers
+    // the blocks it touches
+    std::optional<Rect> crop;
+    if (options_.crop) {
+        int factor = kBlockSize / options_.scale;
+        int x = options_.crop->x / factor;
+        int y = options_.crop->y / factor;
+        int end_x = (options_.crop->x + options_.crop->width + factor - 1) / factor;
+        int end_y = (options_.crop->y + options_.crop->height + factor - 1) / factor;
+        crop = Rect{x, y, end_x - x, end_y - y};
+    }
+    SetupScaling(kBlockSize, crop);
+    FinishProgressive();
+}
+
+void JpgDecoder::StartOutput() {
+    emitted_rows_ = crop_y_;
+    if (!sink_) {
+        image_.SetSize(out_width_, out_height_, options_.pixel_format);
+        return;
+    }
+    // a sink gets rows by MCU rows, so only that many are kept
+    context_->band_.resize(static_cast<size_t>(kBlockSize) * max_vert_thin_ / scale_ *
+                           out_width_ * Channels(options_.pixel_format));
+    sink_->Start(out_width_, out_height_, options_.pixel_format);
+}
+
+void JpgDecoder::EmitRows(int end_row) {
+    int channels = Channels(options_.pixel_format);
+    // gray output needs luma only
+    int used_components = channels == 1 ? 1 : components_num_;
+
+    // planes start at the first MCU column that is kept, rows are
+    // upsampled from there and the crop is taken out of them
+    int mcu_width = kBlockSize * max_hor_thin_ / scale_;
+    int first_col = first_mcu_col_ * mcu_width;
+    int local_width =
+        std::min(last_mcu_col_ * mcu_width, (width_ + scale_ - 1) / scale_) - first_col;
+    int offset = crop_x_ - first_col;
+
+    // planes are looked up once, rows are then upsampled and converted whole
+    PlaneView planes[kMaxComponents];
+    for (int comp_id = 1; comp_id <= used_components; ++comp_id) {
+        const auto& component = components_.at(comp_id);
+        // samples of the image itself, without the padding to whole MCUs
+        int hor_scale = max_hor_thin_ * kBlockSize, vert_scale = max_vert_thin_ * kBlockSize;
+        int blocks_width = component.hor_thin * component.block_size;
+        int width = (width_ * blocks_width + hor_scale - 1) / hor_scale;
+        planes[comp_id - 1] = {
+            &component.matrix(0, 0), static_cast<int>(component.matrix.Columns()),
+            std::min(width, last_mcu_col_ * blocks_width) - first_mcu_col_ * blocks_width,
+            (height_ * component.vert_thin * component.block_size + vert_scale - 1) / vert_scale,
+            static_cast<int>(component.matrix.Rows())};
+    }
+
+    auto& band = context_->band_;
+    auto& upsampled = context_->upsampled_;
+    upsampled.resize(used_components);
+    for (auto& row : upsampled) {
+        row.resize(2 * local_width + 2);
+    }
+    const uint8_t* rows[kMaxComponents];
+    int band_rows = kBlockSize * max_vert_thin_ / scale_;
+    size_t stride = static_cast<size_t>(out_width_) * channels;
+    int band_start = emitted_rows_;
+    for (; emitted_rows_ < end_row; ++emitted_rows_) {
+        for (int comp = 0; comp < used_components; ++comp) {
+            const auto& component = components_.at(comp + 1);
+            rows[comp] = UpsampleRow(planes[comp], component.hor_factor, component.vert_factor,
+                                     emitted_rows_, upsampling_, upsampled[comp].data(),
+                                     local_width) +
+                         offset;
+        }
+        uint8_t* out = sink_ ? band.data() + (emitted_rows_ - band_start) * stride
+                            : image_.Row(emitted_rows_ - crop_y_);
+        if (channels == 1) {
+            std::copy(rows[0], rows[0] + out_width_, out);
+        } else if (used_components == 1) {
+            GrayToRgbRow(rows[0], out, out_width_, channels);
+        } else {
+            YCbCrToRgbRow(rows[0], rows[1], rows[2], out, out_width_, channels);
+        }
+        int done = emitted_rows_ + 1;
+        if (sink_ && (done - band_start == band_rows || done == end_row)) {
+            sink_->WriteRows(band_start - crop_y_, done - band_start, band.data(), stride);
+            band_start = done;
+        }
+    }
+}
+
+Image JpgDecoder::RGBImage() {
+    image_.SetComment(comment_);
+    return std::move(image_);
+}
+
+void JpgDecoder::ReuseImage(Image image) {
+    image_ = std::move(image);
+}
+
+ImageInfo Probe(const uint8_t* data, size_t size) {
+    JpgDecoder decoder(data, size);
+    return decoder.ProbeImage();
+}
+
+ImageInfo Probe(const std::string& filename) {
+    MappedFile file(filename);
+    return Probe(file.Data(), file.Size());
 }
 
-Image Decode(const std::string& filename) {
-    std::ifstream stream(filename, std::ios_base::binary);
-    JpgDecoder decoder(stream);
+Image Decode(const uint8_t* data, size_t size, const DecoderOptions& options) {
+    JpgDecoder decoder(data, size, options);
     decoder.ProcessImage();
     return decoder.RGBImage();
 }
+
+Image Decode(const std::string& filename, const DecoderOptions& options) {
+    MappedFile file(filename);
+    return Decode(file.Data(), file.Size(), options);
+}
+
+void Decode(const uint8_t* data, size_t size, ScanlineSink* sink,
+            const DecoderOptions& options) {
+    JpgDecoder decoder(data, size, options);
+    decoder.ProcessImage(sink);
+}
+
+void Decode(const std::string& filename, ScanlineSink* sink, const DecoderOptions& options) {
+    MappedFile file(filename);
+    Decode(file.Data(), file.Size(), sink, options);
+}
+
+void Decode(const uint8_t* data, size_t size, Image* image, const DecoderOptions& options) {
+    JpgDecoder decoder(data, size, options);
+    decoder.ReuseImage(std::move(*image));
+    try {
+        decoder.ProcessImage();
+    } catch (...) {
+        // the caller keeps its buffer for the next image
+        *image = decoder.RGBImage();
+        throw;
+    }
+    *image = decoder.RGBImage();
+}
+
+void Decode(const std::string& filename, Image* image, const DecoderOptions& options) {
+    MappedFile file(filename);
+    Decode(file.Data(), file.Size(), image, options);
+}
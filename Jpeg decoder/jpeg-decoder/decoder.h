@@ -4,14 +4,106 @@
 #include <map>
 #include <unordered_map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <vector>
 #include "bit_reader.h"
+#include "color.h"
+#ifdef JPEG_DECODER_WITH_FFTW
 #include "fftw3.h"
+#endif
 #include "huffman.h"
+#include "idct.h"
 #include "image.h"
 #include "matrix.h"
 
-Image Decode(const std::string& filename);
+enum class IdctMethod {
+    Integer,  // built-in fixed point transform
+    Fftw      // only when built with FFTW
+};
+
+class DecoderContext;
+
+// reconstructed blocks by where their last nonzero coefficient is, each kind
+// has its own transform
+struct DecoderStats {
+    size_t dc_only_blocks = 0;
+    // nothing outside the top left 4x4 frequencies
+    size_t low_frequency_blocks = 0;
+    size_t full_blocks = 0;
+};
+
+// a rectangle of output pixels
+struct Rect {
+    int x = 0, y = 0;
+    int width = 0, height = 0;
+};
+
+struct DecoderOptions {
+    IdctMethod idct_method = IdctMethod::Integer;
+    // integer IDCT kernel, the best one for this CPU if not set
+    std::optional<SimdLevel> simd_level;
+    Upsampling upsampling = Upsampling::Nearest;
+    // gray keeps only luma of color images
+    PixelFormat pixel_format = PixelFormat::Rgb;
+    // for restart intervals decoded in parallel, 0 is one per core; threads
+    // and their queues cost more than small images take to decode serially,
+    // so it is off unless asked for
+    int threads = 1;
+    // progressive only: stop after the first DC scan and return a 1/8 scale
+    // image with one pixel per block
+    bool dc_preview = false;
+    // 1, 2, 4 or 8: the image comes out that many times smaller, blocks go
+    // through reduced transforms (always integer ones) instead of being
+    // downscaled after decoding
+    int scale = 1;
+    // only this part of the image, in pixels of the scaled output (of
+    // scale, also with dc_preview, whose 1/8 image gets the same area); MCUs
+    // outside it are entropy-decoded for DC prediction only, restart
+    // intervals outside it are skipped, and planes go with the crop width
+    std::optional<Rect> crop;
+    // plans, tables and buffers kept from one call to the next, see
+    // DecoderContext
+    DecoderContext* context = nullptr;
+    // counts of the decode are added here
+    DecoderStats* stats = nullptr;
+};
+
+// the file is mmap'ed rather than read through a stream
+Image Decode(const std::string& filename, const DecoderOptions& options = {});
+Image Decode(const uint8_t* data, size_t size, const DecoderOptions& options = {});
+
+// streams rows into sink as soon as they are decoded, memory stays bounded
+// by a few MCU rows for baseline files
+void Decode(const std::string& filename, ScanlineSink* sink, const DecoderOptions& options = {});
+void Decode(const uint8_t* data, size_t size, ScanlineSink* sink,
+            const DecoderOptions& options = {});
+
+// decodes into image, whose buffer is reused if it's large enough
+void Decode(const std::string& filename, Image* image, const DecoderOptions& options = {});
+void Decode(const uint8_t* data, size_t size, Image* image, const DecoderOptions& options = {});
+
+struct ComponentInfo {
+    int id;
+    // sampling factors, 1 or 2
+    int hor_thin, vert_thin;
+    int quantum_table_id;
+};
+
+// what the frame header says about the image
+struct ImageInfo {
+    int width = 0, height = 0;
+    bool progressive = false;
+    // in the order of the frame header
+    std::vector<ComponentInfo> components;
+    // COM sections before the frame header
+    std::string comment;
+};
+
+// reads markers up to the frame header only, the scans are never looked at
+ImageInfo Probe(const std::string& filename);
+ImageInfo Probe(const uint8_t* data, size_t size);
 
 struct HuffmanTableInfo {
     std::string type;  // AC / DC
@@ -27,12 +119,86 @@ struct HuffmanTableInfo {
     }
 };
 
+// a Huffman table built once and shared by the images that define the same one
+struct HuffmanTable {
+    HuffmanDecoder decoder;
+    // AC only: kLookupBits of input -> coefficient, zeros run and length of
+    // code with magnitude bits, 0 if they don't fit
+    std::vector<int> fast_ac;
+};
+
 struct Component {
     int vert_thin;
     int hor_thin;
     int quantum_table_id;
     HuffmanTableInfo huffman_dc, huffman_ac;
-    Matrix<double> matrix;
+    // looked up once per scan rather than per block; null if the scan
+    // doesn't use them
+    const HuffmanTable* dc_table = nullptr;
+    const HuffmanTable* ac_table = nullptr;
+    const Matrix<uint16_t>* quantum_table = nullptr;
+    Matrix<uint8_t> matrix;  // last two MCU rows of samples
+    // progressive only: coefficients of all blocks in natural order
+    std::vector<int16_t> coefs;
+    int blocks_per_line = 0;
+    bool has_dc = false;
+    // samples per block side at the output scale and how much the plane is
+    // stretched to the output size
+    int block_size = 8;
+    int hor_factor = 1, vert_factor = 1;
+};
+
+// entropy-coded bytes of one restart interval, without the RSTn marker
+struct ScanSegment {
+    const uint8_t* begin;
+    const uint8_t* end;
+};
+
+#ifdef JPEG_DECODER_WITH_FFTW
+// fftw_destroy_plan under the lock of the FFTW planner
+void DestroyFourierPlan(fftw_plan plan);
+#endif
+
+// What decoding of one image leaves to the next one: the FFTW plan with its
+// buffers, built Huffman tables and sample and coefficient buffers, so small
+// images decoded in a loop pay only for the decoding itself. A context is for
+// one decoder at a time.
+class DecoderContext {
+public:
+    DecoderContext() = default;
+    DecoderContext(const DecoderContext&) = delete;
+    DecoderContext& operator=(const DecoderContext&) = delete;
+
+    // FFTW_MEASURE planning takes milliseconds, wisdom saved by one run makes
+    // it instant in the next; false if the file can't be used or there is no FFTW
+    bool ImportFftwWisdom(const std::string& filename);
+    bool ExportFftwWisdom(const std::string& filename) const;
+
+private:
+    friend class JpgDecoder;
+
+    static const size_t kMaxHuffmanTables = 64;
+
+    // by type and DHT bytes
+    std::map<std::string, std::shared_ptr<const HuffmanTable>> huffman_tables_;
+    // by component id
+    std::unordered_map<int, Matrix<uint8_t>> planes_;
+    std::unordered_map<int, std::vector<int16_t>> coefs_;
+    std::vector<std::vector<int16_t>> coef_rows_;
+    // the last nonzero zigzag index of every block in coef_rows_
+    std::vector<std::vector<uint8_t>> coef_row_ends_;
+    // restart intervals of the current scan and whether the crop needs them
+    std::vector<ScanSegment> segments_;
+    std::vector<bool> needed_segments_;
+    std::vector<uint8_t> band_;
+    std::vector<std::vector<uint8_t>> upsampled_;
+
+#ifdef JPEG_DECODER_WITH_FFTW
+    std::unique_ptr<double, decltype(&fftw_free)> in_buffer_{nullptr, fftw_free},
+        out_buffer_{nullptr, fftw_free};
+    std::unique_ptr<fftw_plan_s, decltype(&DestroyFourierPlan)> fourier_plan_{
+        nullptr, DestroyFourierPlan};
+#endif
 };
 
 enum class SectionTitle {
@@ -41,7 +207,9 @@ enum class SectionTitle {
     DHT,
     DQT,
     SOF0,
+    SOF2,
     SOS,
+    DRI,
     EOI,
     APPn,
     NOT_A_SECTION
@@ -54,51 +222,143 @@ struct Section {
 
 class JpgDecoder {
 public:
-    explicit JpgDecoder(std::istream& in_stream)
-        : in_stream_(in_stream),
-          in_buffer_(nullptr, fftw_free),
-          out_buffer_(nullptr, fftw_free),
-          fourier_plan_(nullptr, fftw_destroy_plan) {}
+    // data must live until the decoder is done with it
+    JpgDecoder(const uint8_t* data, size_t size, const DecoderOptions& options = {})
+        : options_(options),
+          context_(options.context ? options.context : &own_context_),
+          cur_(data),
+          end_(data + size) {}
+
+    // reads the whole stream into memory first
+    explicit JpgDecoder(std::istream& in_stream, const DecoderOptions& options = {});
+
+    // gives the buffers back to the context
+    ~JpgDecoder();
+
+    // rows go to sink if it's set, to the image otherwise
+    void ProcessImage(ScanlineSink* sink = nullptr);
 
-    void ProcessImage();
+    // stops at the frame header, tables and APPn sections are skipped
+    ImageInfo ProbeImage();
 
-    Image RGBImage() const;
+    // moves the decoded image out, so it can be taken only once
+    Image RGBImage();
+
+    // the image is decoded into this one's buffer
+    void ReuseImage(Image image);
 
     static const std::unordered_map<int, SectionTitle> kSectionTitles;
     static const int kBlockSize = 8;
+    static const int kMaxComponents = 3;
     static const int kHuffmanMaxLength = 16;
 
 private:
-    std::istream& in_stream_;
+    DecoderOptions options_;
+    DecoderContext own_context_;
+    DecoderContext* context_;
+    std::vector<uint8_t> own_data_;
+    const uint8_t* cur_;
+    const uint8_t* end_;
     int height_, width_;
-    std::unordered_map<int, Matrix<int>> quantum_tables_;
-    std::map<HuffmanTableInfo, HuffmanDecoder> huffman_decoders_;
+    // output size and the scale it is decoded at, the output is the crop
+    // window if there is one
+    int scale_ = 1;
+    int out_height_ = 0, out_width_ = 0;
+    int crop_x_ = 0, crop_y_ = 0;
+    // MCUs that are reconstructed: the crop and the neighbours its
+    // upsampling looks at
+    int first_mcu_row_ = 0, last_mcu_row_ = 0;
+    int first_mcu_col_ = 0, last_mcu_col_ = 0;
+    Upsampling upsampling_ = Upsampling::Nearest;
+    int restart_interval_ = 0;  // in MCUs, 0 if there is no DRI
+    int mcu_per_row_ = 0;
+    bool progressive_ = false;
+    int scans_done_ = 0;
+    // current scan
+    std::vector<int> scan_components_;
+    int spectral_start_ = 0, spectral_end_ = 0;
+    int approximation_high_ = 0, approximation_low_ = 0;
+    std::unordered_map<int, Matrix<uint16_t>> quantum_tables_;
+    std::map<HuffmanTableInfo, std::shared_ptr<const HuffmanTable>> huffman_tables_;
     int components_num_;
     int max_hor_thin_ = 1, max_vert_thin_ = 1;
     std::unordered_map<int, Component> components_;
     std::string comment_;
+    IdctFunction idct_ = nullptr;
+    IdctFunction low_frequency_idct_ = nullptr;
+    std::mutex stats_mutex_;
+    // rows are converted to the output as soon as their MCU row is decoded
+    ScanlineSink* sink_ = nullptr;
+    Image image_;
+    int emitted_rows_ = 0;
 
-    std::unique_ptr<double, decltype(&fftw_free)> in_buffer_, out_buffer_;
-    std::unique_ptr<fftw_plan_s, decltype(&fftw_destroy_plan)> fourier_plan_;
-
-    Matrix<double> GetOneBlock(BitReader* reader, const Component& component,
-                               int* prev_dc_coef);
+    // decodes the next block of component into block_size rows of out stride
+    // apart, or only keeps DC prediction going if out is null
+    void GetOneBlock(BitReader* reader, const Component& component, int* prev_dc_coef,
+                     uint8_t* out, int stride, DecoderStats* stats);
+    // the same, but only down to coefficients in natural order; returns the
+    // zigzag index of the last coefficient set, 0 for a DC only block
+    int DecodeBlock(BitReader* reader, const Component& component, int* prev_dc_coef,
+                    int16_t* coefs);
+    // picks block sizes of components, the output size and the MCUs it
+    // needs for scale; crop is in pixels of that scale
+    void SetupScaling(int scale, const std::optional<Rect>& crop);
+    void PrepareReconstruction();
+    // dequantizes and transforms coefs in natural order, zeros after the
+    // zigzag index last pick a cheaper transform
+    void ReconstructBlock(const int16_t* coefs, int last, const Component& component,
+                          uint8_t* out, int stride, DecoderStats* stats);
+    // adds counts of one thread's work to options_.stats
+    void AddStats(const DecoderStats& stats);
 
     uint8_t ReadOne(int* len = nullptr);
     uint16_t ReadTwo(int* len = nullptr);
 
+    void Skip(int len);
+
     Section NextSection();
 
     void ParseCOM(int len);
     void ParseDHT(int len);
     void ParseDQT(int len);
     void ParseSOF0(int len);
+    ImageInfo ParseFrameHeader(int len);
+    void ParseDRI(int len);
 
     void ParseSOSHeader(int len);
 
     void ValidCheck() const;
 
+    void FindScanSegments(std::vector<ScanSegment>* segments) const;
     void ProcessSOS();
+    bool McuNeeded(int mcu) const;
+    // decodes MCUs [first_mcu, last_mcu), emit converts rows as soon as they are ready
+    void DecodeSegment(const ScanSegment& segment, int first_mcu, int last_mcu, bool emit);
+    // converts what is ready once mcu_rows rows of MCUs are decoded
+    void EmitMcuRows(int mcu_rows);
+    // entropy decoding stays on this thread and hands MCU rows of
+    // coefficients to workers, which transform and convert them
+    void DecodePipelined(const std::vector<ScanSegment>& segments, const std::vector<bool>& needed,
+                         int interval, int mcu_total, int workers, int slots_num);
+    // transforms the kept MCUs of one row, coefs and their last indices go in
+    // the order they were decoded
+    void ReconstructMcuRow(const int16_t* coefs, const uint8_t* ends, int mcu_row);
+    // sizes the image or starts the sink
+    void StartOutput();
+    // converts output rows up to end_row (a row of the whole image) from the
+    // component planes
+    void EmitRows(int end_row);
+
+    void ProcessProgressiveScan();
+    // adds the current scan's part of one block to coefs
+    void DecodeProgressiveBlock(BitReader* reader, const Component& component, int16_t* coefs,
+                                int* prev_dc_coef, int* eob_run);
+    void FinishProgressive();
+    bool DcPreviewReady() const;
+    void MakeDcPreview();
 
+#ifdef JPEG_DECODER_WITH_FFTW
+    Matrix<double> FftwBlock(const int16_t* coefs, const Matrix<uint16_t>& quantum_table);
     void CreateFourierPlan();
+#endif
 };
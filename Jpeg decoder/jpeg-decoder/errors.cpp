@@ -1,7 +1,5 @@
 #include "errors.h"
 
-void Expect(bool condition, const std::string& error_message) {
-    if (!condition) {
-        throw std::runtime_error(error_message);
-    }
+void Fail(const char* error_message) {
+    throw std::runtime_error(error_message);
 }
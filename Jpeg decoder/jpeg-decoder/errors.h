@@ -1,4 +1,13 @@
 #pragma once
 #include <stdexcept>
 
-void Expect(bool condition, const std::string& error_message);
\ No newline at end of file
+// throws std::runtime_error with the message
+[[noreturn]] void Fail(const char* error_message);
+
+// checks sit on per coefficient paths, so the message stays a plain pointer
+// until it is really thrown
+inline void Expect(bool condition, const char* error_message) {
+    if (!condition) {
+        Fail(error_message);
+    }
+}
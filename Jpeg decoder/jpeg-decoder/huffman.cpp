@@ -40,10 +40,50 @@ void HuffmanDecoder::BuildTree(const std::vector<int>& codes_number,
         }
         ++req_depth;
     }
+
+    BuildLookupTable();
+}
+
+void HuffmanDecoder::BuildLookupTable() {
+    lookup_table_.assign(1 << kLookupBits, LookupEntry());
+    for (int bits = 0; bits < (1 << kLookupBits); ++bits) {
+        Node* cur_node = tree_.root;
+        int length = 0;
+        while (cur_node && !cur_node->container.has_value() && length < kLookupBits) {
+            int bit = (bits >> (kLookupBits - 1 - length)) & 1;
+            cur_node = bit ? cur_node->right : cur_node->left;
+            ++length;
+        }
+        auto& entry = lookup_table_[bits];
+        if (!cur_node) {
+            continue;
+        }
+        if (cur_node->container.has_value()) {
+            entry.symbol = cur_node->container.value();
+            entry.length = length;
+        } else {
+            entry.node = cur_node;
+        }
+    }
+}
+
+std::pair<uint8_t, int> HuffmanDecoder::LookupSymbol(int bits) const {
+    const auto& entry = lookup_table_[bits];
+    return {entry.symbol, entry.length};
 }
 
 uint8_t HuffmanDecoder::DecodeSymbol(BitReader* bit_reader) const {
-    Node* cur_node = tree_.root;
+    Expect(!lookup_table_.empty(), "Huffman table is not built");
+    const auto& entry = lookup_table_[bit_reader->Peek(kLookupBits)];
+    if (entry.length != 0) {
+        bit_reader->Consume(entry.length);
+        return entry.symbol;
+    }
+
+    // rare long code, walk the rest of the tree bit by bit
+    Node* cur_node = entry.node;
+    Expect(cur_node, "Wrong huffman code");
+    bit_reader->Consume(kLookupBits);
     while (!cur_node->container.has_value()) {
         if (bit_reader->Get() == 0) {
             Expect(cur_node->left, "Wrong huffman code");
@@ -55,3 +95,13 @@ uint8_t HuffmanDecoder::DecodeSymbol(BitReader* bit_reader) const {
     }
     return cur_node->container.value();
 }
+
+uint8_t HuffmanDecoder::DecodeSymbolByTree(BitReader* bit_reader) const {
+    Node* cur_node = tree_.root;
+    Expect(cur_node, "Huffman table is not built");
+    while (!cur_node->container.has_value()) {
+        cur_node = bit_reader->Get() == 0 ? cur_node->left : cur_node->right;
+        Expect(cur_node, "Wrong huffman code");
+    }
+    return cur_node->container.value();
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <memory>
 #include <optional>
+#include <utility>
 #include <vector>
 #include "bit_reader.h"
 
@@ -39,7 +40,25 @@ public:
                    const std::vector<uint8_t>& codes_values);
 
     uint8_t DecodeSymbol(BitReader* bit_reader) const;
+    // same result as DecodeSymbol without the lookup table, one bit at a time
+    uint8_t DecodeSymbolByTree(BitReader* bit_reader) const;
+
+    // symbol whose code is a prefix of the kLookupBits long bits and the
+    // code length, length is 0 if the code is longer or there is no such code
+    std::pair<uint8_t, int> LookupSymbol(int bits) const;
+
+    static const int kLookupBits = 9;
 
 private:
+    struct LookupEntry {
+        uint8_t symbol = 0;
+        uint8_t length = 0;
+        // for codes longer than kLookupBits: where to continue the tree walk
+        Node* node = nullptr;
+    };
+
+    void BuildLookupTable();
+
     HuffmanTree tree_;
+    std::vector<LookupEntry> lookup_table_;
 };
@@ -0,0 +1,368 @@
+#include "idct.h"
+#include "errors.h"
+#include "idct_kernel.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef JPEG_DECODER_WITH_AVX2
+// lives in idct_avx2.cpp, the only file built with AVX2 enabled
+void IdctAvx2(const int16_t* coefs, const uint16_t* quant, uint8_t* out, int stride);
+void IdctLowFrequencyAvx2(const int16_t* coefs, const uint16_t* quant, uint8_t* out,
+                          int stride);
+#endif
+
+namespace {
+using namespace idct_kernel;
+
+// the scalar version keeps 64 bits and skips empty columns instead of
+// pretending to be a vector of one lane
+
+int64_t Descale(int64_t value, int bits) {
+    return (value + (int64_t(1) << (bits - 1))) >> bits;
+}
+
+// one 1-D transform, in[i] is the i-th frequency, results go to out[i]
+// shifted right by descale_bits
+void Transform(int64_t in0, int64_t in1, int64_t in2, int64_t in3, int64_t in4,
+               int64_t in5, int64_t in6, int64_t in7, int descale_bits, int64_t* out,
+               int out_step) {
+    // even part
+    int64_t z1 = (in2 + in6) * kFix0_541196100;
+    int64_t tmp2 = z1 - in6 * kFix1_847759065;
+    int64_t tmp3 = z1 + in2 * kFix0_765366865;
+    int64_t tmp0 = (in0 + in4) * (1 << kConstBits);
+    int64_t tmp1 = (in0 - in4) * (1 << kConstBits);
+
+    int64_t tmp10 = tmp0 + tmp3;
+    int64_t tmp13 = tmp0 - tmp3;
+    int64_t tmp11 = tmp1 + tmp2;
+    int64_t tmp12 = tmp1 - tmp2;
+
+    // odd part
+    tmp0 = in7;
+    tmp1 = in5;
+    tmp2 = in3;
+    tmp3 = in1;
+    z1 = tmp0 + tmp3;
+    int64_t z2 = tmp1 + tmp2;
+    int64_t z3 = tmp0 + tmp2;
+    int64_t z4 = tmp1 + tmp3;
+    int64_t z5 = (z3 + z4) * kFix1_175875602;
+
+    tmp0 *= kFix0_298631336;
+    tmp1 *= kFix2_053119869;
+    tmp2 *= kFix3_072711026;
+    tmp3 *= kFix1_501321110;
+    z1 *= -kFix0_899976223;
+    z2 *= -kFix2_562915447;
+    z3 = z3 * -kFix1_961570560 + z5;
+    z4 = z4 * -kFix0_390180644 + z5;
+
+    tmp0 += z1 + z3;
+    tmp1 += z2 + z4;
+    tmp2 += z2 + z3;
+    tmp3 += z1 + z4;
+
+    out[0 * out_step] = Descale(tmp10 + tmp3, descale_bits);
+    out[7 * out_step] = Descale(tmp10 - tmp3, descale_bits);
+    out[1 * out_step] = Descale(tmp11 + tmp2, descale_bits);
+    out[6 * out_step] = Descale(tmp11 - tmp2, descale_bits);
+    out[2 * out_step] = Descale(tmp12 + tmp1, descale_bits);
+    out[5 * out_step] = Descale(tmp12 - tmp1, descale_bits);
+    out[3 * out_step] = Descale(tmp13 + tmp0, descale_bits);
+    out[4 * out_step] = Descale(tmp13 - tmp0, descale_bits);
+}
+
+// extra constants of the reduced transforms
+constexpr int64_t kFix0_211164243 = 1730;
+constexpr int64_t kFix0_509795579 = 4176;
+constexpr int64_t kFix0_601344887 = 4926;
+constexpr int64_t kFix0_720959822 = 5906;
+constexpr int64_t kFix0_850430095 = 6967;
+constexpr int64_t kFix1_061594337 = 8697;
+constexpr int64_t kFix1_272758580 = 10426;
+constexpr int64_t kFix1_451774981 = 11893;
+constexpr int64_t kFix2_172734803 = 17799;
+constexpr int64_t kFix3_624509785 = 29692;
+
+uint8_t Sample(int64_t value) {
+    return static_cast<uint8_t>(std::clamp<int64_t>(value + 128, 0, 255));
+}
+
+// 4 samples from frequencies 0..7 except 4, which falls between them
+void Transform4(const int64_t* in, int descale_bits, int64_t* out, int out_step) {
+    // even part
+    int64_t tmp0 = in[0] * (int64_t(1) << (kConstBits + 1));
+    int64_t tmp2 = in[2] * kFix1_847759065 - in[6] * kFix0_765366865;
+    int64_t tmp10 = tmp0 + tmp2;
+    int64_t tmp12 = tmp0 - tmp2;
+
+    // odd part
+    int64_t z1 = in[7], z2 = in[5], z3 = in[3],
+            z4 = in[1];
+    tmp0 = -z1 * kFix0_211164243 + z2 * kFix1_451774981 - z3 * kFix2_172734803 +
+           z4 * kFix1_061594337;
+    tmp2 = -z1 * kFix0_509795579 - z2 * kFix0_601344887 + z3 * kFix0_899976223 +
+           z4 * kFix2_562915447;
+
+    out[0 * out_step] = Descale(tmp10 + tmp2, descale_bits);
+    out[3 * out_step] = Descale(tmp10 - tmp2, descale_bits);
+    out[1 * out_step] = Descale(tmp12 + tmp0, descale_bits);
+    out[2 * out_step] = Descale(tmp12 - tmp0, descale_bits);
+}
+
+// 2 samples from frequencies 0 and the odd ones
+void Transform2(const int64_t* in, int descale_bits, int64_t* out, int out_step) {
+    int64_t tmp10 = in[0] * (int64_t(1) << (kConstBits + 2));
+    int64_t tmp0 = -in[7] * kFix0_720959822 + in[5] * kFix0_850430095 -
+                   in[3] * kFix1_272758580 + in[1] * kFix3_624509785;
+    out[0] = Descale(tmp10 + tmp0, descale_bits);
+    out[out_step] = Descale(tmp10 - tmp0, descale_bits);
+}
+
+// Size samples per side: columns first, then rows, like the full transform;
+// each pass of the reduced transforms has one more bit to drop
+template <int Size, void (*Transform1D)(const int64_t*, int, int64_t*, int)>
+void IdctReduced(const int16_t* coefs, const uint16_t* quant, uint8_t* out, int stride) {
+    constexpr int kExtraBits = Size == 4 ? 1 : 2;
+    int64_t column[8];
+    int64_t workspace[Size * 8] = {};
+    for (int col = 0; col < 8; ++col) {
+        // even columns past the output size don't reach it
+        if (col != 0 && col % 2 == 0 && (Size == 2 || col == 4)) {
+            continue;
+        }
+        for (int row = 0; row < 8; ++row) {
+            column[row] = int64_t(coefs[row * 8 + col]) * quant[row * 8 + col];
+        }
+        Transform1D(column, kConstBits - kPass1Bits + kExtraBits, workspace + col, 8);
+    }
+
+    int64_t row_out[Size];
+    for (int row = 0; row < Size; ++row) {
+        Transform1D(workspace + row * 8, kConstBits + kPass1Bits + 3 + kExtraBits, row_out, 1);
+        for (int col = 0; col < Size; ++col) {
+            out[row * stride + col] = Sample(row_out[col]);
+        }
+    }
+}
+
+// the block mean
+void Idct1x1(const int16_t* coefs, const uint16_t* quant, uint8_t* out, int) {
+    *out = Sample(Descale(int64_t(coefs[0]) * quant[0], 3));
+}
+
+#ifdef __SSE2__
+// 4 lanes of 32 bits, SSE2 has no 32-bit mullo so it is made of two mul_epu32
+struct Sse2Ops {
+    using Vec = __m128i;
+    static constexpr int kLanes = 4;
+
+    static Vec Set1(int32_t value) {
+        return _mm_set1_epi32(value);
+    }
+    static Vec Add(Vec a, Vec b) {
+        return _mm_add_epi32(a, b);
+    }
+    static Vec Sub(Vec a, Vec b) {
+        return _mm_sub_epi32(a, b);
+    }
+    static Vec MulLo(Vec a, Vec b) {
+        Vec even = _mm_mul_epu32(a, b);
+        Vec odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+    }
+    static Vec Mul(Vec a, int32_t b) {
+        return MulLo(a, _mm_set1_epi32(b));
+    }
+    static Vec ShiftLeft(Vec a, int bits) {
+        return _mm_sll_epi32(a, _mm_cvtsi32_si128(bits));
+    }
+    static Vec ShiftRight(Vec a, int bits) {
+        return _mm_sra_epi32(a, _mm_cvtsi32_si128(bits));
+    }
+    static Vec LoadDequant(const int16_t* coefs, const uint16_t* quant) {
+        Vec c = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(coefs));
+        Vec q = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(quant));
+        c = _mm_srai_epi32(_mm_unpacklo_epi16(c, c), 16);
+        q = _mm_unpacklo_epi16(q, _mm_setzero_si128());
+        return MulLo(c, q);
+    }
+    static void Transpose4x4(Vec* a, Vec* b, Vec* c, Vec* d) {
+        Vec t0 = _mm_unpacklo_epi32(*a, *b);
+        Vec t1 = _mm_unpacklo_epi32(*c, *d);
+        Vec t2 = _mm_unpackhi_epi32(*a, *b);
+        Vec t3 = _mm_unpackhi_epi32(*c, *d);
+        *a = _mm_unpacklo_epi64(t0, t1);
+        *b = _mm_unpackhi_epi64(t0, t1);
+        *c = _mm_unpacklo_epi64(t2, t3);
+        *d = _mm_unpackhi_epi64(t2, t3);
+    }
+    // matrix[row * 2 + half], transposes the four 4x4 quarters and swaps two of them
+    static void Transpose(Vec* matrix) {
+        for (int quarter = 0; quarter < 4; ++quarter) {
+            int row = (quarter / 2) * 4;
+            int half = quarter % 2;
+            Vec* base = matrix + row * 2 + half;
+            Transpose4x4(base, base + 2, base + 4, base + 6);
+        }
+        for (int row = 0; row < 4; ++row) {
+            std::swap(matrix[row * 2 + 1], matrix[(row + 4) * 2]);
+        }
+    }
+    static void StoreRow(const Vec* row, uint8_t* out) {
+        Vec words = _mm_packs_epi32(row[0], row[1]);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(words, words));
+    }
+};
+#endif
+}  // namespace
+
+void IdctScalar(const int16_t* coefs, const uint16_t* quant, uint8_t* out, int stride) {
+    // 64 bits are for broken files only, no overflow can be reached with real ones
+    int64_t workspace[64];
+
+    // pass 1: columns, dequantized on the way, kPass1Bits of extra precision
+    for (int col = 0; col < 8; ++col) {
+        const int16_t* in = coefs + col;
+        const uint16_t* q = quant + col;
+        bool only_dc = true;
+        for (int row = 1; row < 8; ++row) {
+            if (in[row * 8] != 0) {
+                only_dc = false;
+                break;
+            }
+        }
+        if (only_dc) {
+            int64_t dc = int64_t(in[0]) * q[0] * (1 << kPass1Bits);
+            for (int row = 0; row < 8; ++row) {
+                workspace[row * 8 + col] = dc;
+            }
+            continue;
+        }
+        Transform(int64_t(in[0]) * q[0], int64_t(in[8]) * q[8], int64_t(in[16]) * q[16],
+                  int64_t(in[24]) * q[24], int64_t(in[32]) * q[32], int64_t(in[40]) * q[40],
+                  int64_t(in[48]) * q[48], int64_t(in[56]) * q[56],
+                  kConstBits - kPass1Bits, workspace + col, 8);
+    }
+
+    // pass 2: rows, drops the extra precision and divides by 8
+    int64_t row_out[8];
+    for (int row = 0; row < 8; ++row) {
+        const int64_t* in = workspace + row * 8;
+        Transform(in[0], in[1], in[2], in[3], in[4], in[5], in[6], in[7],
+                  kConstBits + kPass1Bits + 3, row_out, 1);
+        for (int col = 0; col < 8; ++col) {
+            out[row * stride + col] =
+                static_cast<uint8_t>(std::clamp<int64_t>(row_out[col] + 128, 0, 255));
+        }
+    }
+}
+
+void IdctDcOnly(const int16_t* coefs, const uint16_t* quant, uint8_t* out, int stride) {
+    // both passes of the full transform come down to dc / 8 with rounding
+    int64_t value = Descale(int64_t(coefs[0]) * quant[0], 3);
+    uint8_t sample = std::clamp<int64_t>(value + 128, 0, 255);
+    for (int row = 0; row < 8; ++row) {
+        std::memset(out + row * stride, sample, 8);
+    }
+}
+
+void IdctLowFrequencyScalar(const int16_t* coefs, const uint16_t* quant, uint8_t* out,
+                            int stride) {
+    // the right four columns of the workspace would be zeros, so it keeps
+    // only the left ones
+    int64_t workspace[32];
+    for (int col = 0; col < 4; ++col) {
+        const int16_t* in = coefs + col;
+        const uint16_t* q = quant + col;
+        Transform(int64_t(in[0]) * q[0], int64_t(in[8]) * q[8], int64_t(in[16]) * q[16],
+                  int64_t(in[24]) * q[24], 0, 0, 0, 0, kConstBits - kPass1Bits,
+                  workspace + col, 4);
+    }
+    int64_t row_out[8];
+    for (int row = 0; row < 8; ++row) {
+        const int64_t* in = workspace + row * 4;
+        Transform(in[0], in[1], in[2], in[3], 0, 0, 0, 0, kConstBits + kPass1Bits + 3, row_out,
+                  1);
+        for (int col = 0; col < 8; ++col) {
+            out[row * stride + col] =
+                static_cast<uint8_t>(std::clamp<int64_t>(row_out[col] + 128, 0, 255));
+        }
+    }
+}
+
+IdctFunction GetScaledIdct(int size) {
+    switch (size) {
+        case 4:
+            return IdctReduced<4, Transform4>;
+        case 2:
+            return IdctReduced<2, Transform2>;
+        case 1:
+            return Idct1x1;
+        default:
+            throw std::runtime_error("Not valid size of a reduced IDCT");
+    }
+}
+
+#ifdef __SSE2__
+void IdctSse2(const int16_t* coefs, const uint16_t* quant, uint8_t* out, int stride) {
+    idct_kernel::Idct<Sse2Ops>(coefs, quant, out, stride);
+}
+
+void IdctLowFrequencySse2(const int16_t* coefs, const uint16_t* quant, uint8_t* out,
+                          int stride) {
+    idct_kernel::Idct<Sse2Ops, 4>(coefs, quant, out, stride);
+}
+#endif
+
+SimdLevel BestSimdLevel() {
+#ifdef JPEG_DECODER_WITH_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::Avx2;
+    }
+#endif
+#ifdef __SSE2__
+    return SimdLevel::Sse2;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+IdctFunction GetIdct(SimdLevel level) {
+    Expect(level <= BestSimdLevel(), "SIMD level is not supported on this machine");
+    switch (level) {
+#ifdef JPEG_DECODER_WITH_AVX2
+        case SimdLevel::Avx2:
+            return IdctAvx2;
+#endif
+#ifdef __SSE2__
+        case SimdLevel::Sse2:
+            return IdctSse2;
+#endif
+        default:
+            return IdctScalar;
+    }
+}
+
+IdctFunction GetLowFrequencyIdct(SimdLevel level) {
+    Expect(level <= BestSimdLevel(), "SIMD level is not supported on this machine");
+    switch (level) {
+#ifdef JPEG_DECODER_WITH_AVX2
+        case SimdLevel::Avx2:
+            return IdctLowFrequencyAvx2;
+#endif
+#ifdef __SSE2__
+        case SimdLevel::Sse2:
+            return IdctLowFrequencySse2;
+#endif
+        default:
+            return IdctLowFrequencyScalar;
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+
+enum class SimdLevel {
+    Scalar,
+    Sse2,
+    Avx2
+};
+
+// Integer inverse DCT of one 8x8 block (Loeffler-Ligtenberg-Moschytz flow
+// graph, 13-bit fixed point constants) with dequantization folded into the
+// first pass, +128 level shift and clamping to [0, 255]. coefs and quant are
+// 64 values in natural (not zigzag) order, out gets 8 rows stride apart.
+// All kernels give exactly the same samples for any real jpg data.
+using IdctFunction = void (*)(const int16_t* coefs, const uint16_t* quant, uint8_t* out,
+                              int stride);
+
+void IdctScalar(const int16_t* coefs, const uint16_t* quant, uint8_t* out, int stride);
+
+// Shortcuts for sparse blocks, exactly the samples of the full transform.
+// Only coefs[0] may be nonzero: the block is one flat value.
+void IdctDcOnly(const int16_t* coefs, const uint16_t* quant, uint8_t* out, int stride);
+// Only the top left 4x4 frequencies may be nonzero: half the columns and
+// half the inputs of every row are skipped.
+void IdctLowFrequencyScalar(const int16_t* coefs, const uint16_t* quant, uint8_t* out,
+                            int stride);
+
+// Reduced transforms for scaled decoding, the same math as libjpeg's
+// jidctred: a block gives only 4x4, 2x2 or 1x1 samples and the frequencies
+// they can't show are not computed at all. size is 4, 2 or 1.
+IdctFunction GetScaledIdct(int size);
+
+// the best level this CPU and build can do
+SimdLevel BestSimdLevel();
+
+// throws if the level is not supported here
+IdctFunction GetIdct(SimdLevel level);
+// the same for blocks with only the top left 4x4 frequencies
+IdctFunction GetLowFrequencyIdct(SimdLevel level);
@@ -0,0 +1,79 @@
+// Built with -mavx2, nothing from here may be called before BestSimdLevel()
+// says the CPU has it.
+#include "idct_kernel.h"
+#include <cstdint>
+#include <immintrin.h>
+
+namespace {
+struct Avx2Ops {
+    using Vec = __m256i;
+    static constexpr int kLanes = 8;
+
+    static Vec Set1(int32_t value) {
+        return _mm256_set1_epi32(value);
+    }
+    static Vec Add(Vec a, Vec b) {
+        return _mm256_add_epi32(a, b);
+    }
+    static Vec Sub(Vec a, Vec b) {
+        return _mm256_sub_epi32(a, b);
+    }
+    static Vec Mul(Vec a, int32_t b) {
+        return _mm256_mullo_epi32(a, _mm256_set1_epi32(b));
+    }
+    static Vec ShiftLeft(Vec a, int bits) {
+        return _mm256_sll_epi32(a, _mm_cvtsi32_si128(bits));
+    }
+    static Vec ShiftRight(Vec a, int bits) {
+        return _mm256_sra_epi32(a, _mm_cvtsi32_si128(bits));
+    }
+    static Vec LoadDequant(const int16_t* coefs, const uint16_t* quant) {
+        Vec c = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(coefs)));
+        Vec q = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(quant)));
+        return _mm256_mullo_epi32(c, q);
+    }
+    static void Transpose(Vec* m) {
+        Vec t0 = _mm256_unpacklo_epi32(m[0], m[1]);
+        Vec t1 = _mm256_unpackhi_epi32(m[0], m[1]);
+        Vec t2 = _mm256_unpacklo_epi32(m[2], m[3]);
+        Vec t3 = _mm256_unpackhi_epi32(m[2], m[3]);
+        Vec t4 = _mm256_unpacklo_epi32(m[4], m[5]);
+        Vec t5 = _mm256_unpackhi_epi32(m[4], m[5]);
+        Vec t6 = _mm256_unpacklo_epi32(m[6], m[7]);
+        Vec t7 = _mm256_unpackhi_epi32(m[6], m[7]);
+
+        Vec u0 = _mm256_unpacklo_epi64(t0, t2);
+        Vec u1 = _mm256_unpackhi_epi64(t0, t2);
+        Vec u2 = _mm256_unpacklo_epi64(t1, t3);
+        Vec u3 = _mm256_unpackhi_epi64(t1, t3);
+        Vec u4 = _mm256_unpacklo_epi64(t4, t6);
+        Vec u5 = _mm256_unpackhi_epi64(t4, t6);
+        Vec u6 = _mm256_unpacklo_epi64(t5, t7);
+        Vec u7 = _mm256_unpackhi_epi64(t5, t7);
+
+        m[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+        m[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+        m[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+        m[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+        m[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+        m[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+        m[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+        m[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+    }
+    static void StoreRow(const Vec* row, uint8_t* out) {
+        Vec value = *row;
+        __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(value),
+                                        _mm256_extracti128_si256(value, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(words, words));
+    }
+};
+}  // namespace
+
+void IdctAvx2(const int16_t* coefs, const uint16_t* quant, uint8_t* out, int stride) {
+    idct_kernel::Idct<Avx2Ops>(coefs, quant, out, stride);
+}
+
+void IdctLowFrequencyAvx2(const int16_t* coefs, const uint16_t* quant, uint8_t* out,
+                          int stride) {
+    idct_kernel::Idct<Avx2Ops, 4>(coefs, quant, out, stride);
+}
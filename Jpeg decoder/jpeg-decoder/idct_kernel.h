@@ -0,0 +1,124 @@
+#pragma once
+#include <cstdint>
+
+// The integer IDCT written once for any set of vector operations on int32
+// lanes. Ops provides Vec, kLanes (4 or 8) and the operations used below;
+// an 8x8 matrix of int32 is kept as 8 * 8 / kLanes vectors, row by row.
+namespace idct_kernel {
+
+constexpr int kConstBits = 13;
+constexpr int kPass1Bits = 2;
+
+// cos constants scaled by 2^kConstBits
+constexpr int32_t kFix0_298631336 = 2446;
+constexpr int32_t kFix0_390180644 = 3196;
+constexpr int32_t kFix0_541196100 = 4433;
+constexpr int32_t kFix0_765366865 = 6270;
+constexpr int32_t kFix0_899976223 = 7373;
+constexpr int32_t kFix1_175875602 = 9633;
+constexpr int32_t kFix1_501321110 = 12299;
+constexpr int32_t kFix1_847759065 = 15137;
+constexpr int32_t kFix1_961570560 = 16069;
+constexpr int32_t kFix2_053119869 = 16819;
+constexpr int32_t kFix2_562915447 = 20995;
+constexpr int32_t kFix3_072711026 = 25172;
+
+// one 1-D transform of in[0..7] (frequencies) into out[0..7] (samples)
+// shifted right by descale_bits with rounding
+template <class Ops>
+void Transform(const typename Ops::Vec* in, int descale_bits, typename Ops::Vec* out) {
+    using Vec = typename Ops::Vec;
+
+    // even part
+    Vec z1 = Ops::Mul(Ops::Add(in[2], in[6]), kFix0_541196100);
+    Vec tmp2 = Ops::Sub(z1, Ops::Mul(in[6], kFix1_847759065));
+    Vec tmp3 = Ops::Add(z1, Ops::Mul(in[2], kFix0_765366865));
+    Vec tmp0 = Ops::ShiftLeft(Ops::Add(in[0], in[4]), kConstBits);
+    Vec tmp1 = Ops::ShiftLeft(Ops::Sub(in[0], in[4]), kConstBits);
+
+    Vec tmp10 = Ops::Add(tmp0, tmp3);
+    Vec tmp13 = Ops::Sub(tmp0, tmp3);
+    Vec tmp11 = Ops::Add(tmp1, tmp2);
+    Vec tmp12 = Ops::Sub(tmp1, tmp2);
+
+    // odd part
+    z1 = Ops::Add(in[7], in[1]);
+    Vec z2 = Ops::Add(in[5], in[3]);
+    Vec z3 = Ops::Add(in[7], in[3]);
+    Vec z4 = Ops::Add(in[5], in[1]);
+    Vec z5 = Ops::Mul(Ops::Add(z3, z4), kFix1_175875602);
+
+    tmp0 = Ops::Mul(in[7], kFix0_298631336);
+    tmp1 = Ops::Mul(in[5], kFix2_053119869);
+    tmp2 = Ops::Mul(in[3], kFix3_072711026);
+    tmp3 = Ops::Mul(in[1], kFix1_501321110);
+    z1 = Ops::Mul(z1, -kFix0_899976223);
+    z2 = Ops::Mul(z2, -kFix2_562915447);
+    z3 = Ops::Add(Ops::Mul(z3, -kFix1_961570560), z5);
+    z4 = Ops::Add(Ops::Mul(z4, -kFix0_390180644), z5);
+
+    tmp0 = Ops::Add(tmp0, Ops::Add(z1, z3));
+    tmp1 = Ops::Add(tmp1, Ops::Add(z2, z4));
+    tmp2 = Ops::Add(tmp2, Ops::Add(z2, z3));
+    tmp3 = Ops::Add(tmp3, Ops::Add(z1, z4));
+
+    Vec round = Ops::Set1(1 << (descale_bits - 1));
+    auto descale = [&](Vec value) { return Ops::ShiftRight(Ops::Add(value, round), descale_bits); };
+    out[0] = descale(Ops::Add(tmp10, tmp3));
+    out[7] = descale(Ops::Sub(tmp10, tmp3));
+    out[1] = descale(Ops::Add(tmp11, tmp2));
+    out[6] = descale(Ops::Sub(tmp11, tmp2));
+    out[2] = descale(Ops::Add(tmp12, tmp1));
+    out[5] = descale(Ops::Sub(tmp12, tmp1));
+    out[3] = descale(Ops::Add(tmp13, tmp0));
+    out[4] = descale(Ops::Sub(tmp13, tmp0));
+}
+
+// kInputs is 8, or 4 when only the top left 4x4 frequencies may be nonzero:
+// the rest is known to be zero, so it is neither loaded nor multiplied
+template <class Ops, int kInputs = 8>
+void Idct(const int16_t* coefs, const uint16_t* quant, uint8_t* out, int stride) {
+    using Vec = typename Ops::Vec;
+    constexpr int kGroups = 8 / Ops::kLanes;
+
+    Vec matrix[8 * kGroups];
+    Vec in[8], res[8];
+
+    // pass 1: columns, kLanes of them at once
+    for (int group = 0; group < kGroups; ++group) {
+        if (group * Ops::kLanes >= kInputs) {
+            for (int row = 0; row < 8; ++row) {
+                matrix[row * kGroups + group] = Ops::Set1(0);
+            }
+            continue;
+        }
+        for (int row = 0; row < 8; ++row) {
+            int offset = row * 8 + group * Ops::kLanes;
+            in[row] = row < kInputs ? Ops::LoadDequant(coefs + offset, quant + offset)
+                                    : Ops::Set1(0);
+        }
+        Transform<Ops>(in, kConstBits - kPass1Bits, res);
+        for (int row = 0; row < 8; ++row) {
+            matrix[row * kGroups + group] = res[row];
+        }
+    }
+
+    // pass 2: rows, transposed to be columns again
+    Ops::Transpose(matrix);
+    for (int group = 0; group < kGroups; ++group) {
+        for (int col = 0; col < 8; ++col) {
+            in[col] = col < kInputs ? matrix[col * kGroups + group] : Ops::Set1(0);
+        }
+        Transform<Ops>(in, kConstBits + kPass1Bits + 3, res);
+        for (int col = 0; col < 8; ++col) {
+            matrix[col * kGroups + group] = Ops::Add(res[col], Ops::Set1(128));
+        }
+    }
+
+    Ops::Transpose(matrix);
+    for (int row = 0; row < 8; ++row) {
+        Ops::StoreRow(matrix + row * kGroups, out + row * stride);
+    }
+}
+
+}  // namespace idct_kernel
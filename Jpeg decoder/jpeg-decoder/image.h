@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -8,35 +9,101 @@ struct RGB {
     int r, g, b;
 };
 
+enum class PixelFormat {
+    Gray,
+    Rgb,
+    Rgba  // alpha is always opaque
+};
+
+inline int Channels(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::Gray:
+            return 1;
+        case PixelFormat::Rgb:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+// One contiguous buffer of interleaved 8-bit pixels, rows are Stride() bytes
+// apart.
 class Image {
 public:
     Image() {}
-    Image(size_t width, size_t height) { SetSize(width, height); }
-
-    void SetSize(size_t width, size_t height) {
-        data_.assign(height, std::vector<RGB>(width));
+    Image(size_t width, size_t height, PixelFormat format = PixelFormat::Rgb) {
+        SetSize(width, height, format);
     }
 
-    size_t Width() const {
-        if (data_.empty()) {
-            return 0;
-        }
-        return data_[0].size();
+    void SetSize(size_t width, size_t height, PixelFormat format = PixelFormat::Rgb) {
+        width_ = width;
+        height_ = height;
+        format_ = format;
+        stride_ = width * Channels(format);
+        data_.assign(stride_ * height, 0);
     }
 
-    size_t Height() const { return data_.size(); }
+    size_t Width() const { return width_; }
+
+    size_t Height() const { return height_; }
+
+    PixelFormat Format() const { return format_; }
+
+    size_t Stride() const { return stride_; }
+
+    uint8_t* Row(size_t y) { return data_.data() + y * stride_; }
+
+    const uint8_t* Row(size_t y) const { return data_.data() + y * stride_; }
 
-    void SetPixel(int y, int x, const RGB& pixel) { data_[y][x] = pixel; }
+    uint8_t* Data() { return data_.data(); }
 
-    RGB GetPixel(int y, int x) const { return data_[y][x]; }
+    const uint8_t* Data() const { return data_.data(); }
 
-    RGB& GetPixel(int y, int x) { return data_[y][x]; }
+    // per pixel access is slow, use rows for anything big
+    void SetPixel(int y, int x, const RGB& pixel) {
+        uint8_t* pos = Row(y) + x * Channels(format_);
+        if (format_ == PixelFormat::Gray) {
+            pos[0] = (pixel.r * 19595 + pixel.g * 38470 + pixel.b * 7471 + 32768) >> 16;
+            return;
+        }
+        pos[0] = pixel.r;
+        pos[1] = pixel.g;
+        pos[2] = pixel.b;
+        if (format_ == PixelFormat::Rgba) {
+            pos[3] = 255;
+        }
+    }
+
+    RGB GetPixel(int y, int x) const {
+        const uint8_t* pos = Row(y) + x * Channels(format_);
+        if (format_ == PixelFormat::Gray) {
+            return {pos[0], pos[0], pos[0]};
+        }
+        return {pos[0], pos[1], pos[2]};
+    }
 
     void SetComment(const std::string& comment) { comment_ = comment; }
 
     const std::string& GetComment() const { return comment_; }
 
 private:
-    std::vector<std::vector<RGB>> data_;
+    std::vector<uint8_t> data_;
+    size_t width_ = 0, height_ = 0, stride_ = 0;
+    PixelFormat format_ = PixelFormat::Rgb;
     std::string comment_;
 };
+
+// Receives decoded pixels row by row instead of a whole Image. Rows come in
+// order, all Height() of them unless decoding fails.
+class ScanlineSink {
+public:
+    virtual ~ScanlineSink() = default;
+
+    // called once before any rows
+    virtual void Start(size_t width, size_t height, PixelFormat format) = 0;
+
+    // rows [first_row, first_row + rows_num), stride bytes apart, the data
+    // is only valid during the call
+    virtual void WriteRows(size_t first_row, size_t rows_num, const uint8_t* data,
+                           size_t stride) = 0;
+};
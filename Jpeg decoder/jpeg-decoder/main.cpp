@@ -1,25 +1,261 @@
 #include "decoder.h"
+#include "mapped_file.h"
+#include "pipeline.h"
 #include "png_encoder.h"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 
+namespace fs = std::filesystem;
 
-void DecodeAndWriteToPng(const std::string& filename) {
-    auto image = Decode(filename);
-    auto dot_pos = filename.find("jpg") - 1;
-    std::string png_filename(filename.substr(0, dot_pos) + ".png");
-    WritePng(png_filename, image);
+// usage: jpeg_decoder [-j threads] [--in-flight images] [-z level] [--filter name]
+//                     <jpg or directory>...
+// every jpg becomes a png next to it; without arguments the examples are converted
+struct BatchOptions {
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    // images being decoded or encoded at once, bounds the memory
+    int in_flight = 0;
+    PngOptions png;
+    std::vector<std::string> inputs;
+};
+
+struct FileResult {
+    std::string filename;
+    size_t width = 0, height = 0;
+    size_t input_bytes = 0;
+    double seconds = 0;
+    DecoderStats stats;
+    std::string error;
+};
+
+// passes rows on and remembers the size of the image
+class SizeTracker : public ScanlineSink {
+public:
+    explicit SizeTracker(ScanlineSink* next) : next_(next) {}
+
+    void Start(size_t width, size_t height, PixelFormat format) override {
+        width_ = width;
+        height_ = height;
+        next_->Start(width, height, format);
+    }
+
+    void WriteRows(size_t first_row, size_t rows_num, const uint8_t* data,
+                   size_t stride) override {
+        next_->WriteRows(first_row, rows_num, data, stride);
+    }
+
+    size_t Width() const {
+        return width_;
+    }
+
+    size_t Height() const {
+        return height_;
+    }
+
+private:
+    ScanlineSink* next_;
+    size_t width_ = 0, height_ = 0;
+};
+
+bool IsJpg(const fs::path& path) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == ".jpg" || extension == ".jpeg";
 }
 
+std::vector<std::string> CollectFiles(const std::vector<std::string>& inputs) {
+    std::vector<std::string> files;
+    for (const auto& input : inputs) {
+        if (!fs::is_directory(input)) {
+            files.push_back(input);
+            continue;
+        }
+        std::vector<std::string> found;
+        for (const auto& entry : fs::directory_iterator(input)) {
+            if (entry.is_regular_file() && IsJpg(entry.path())) {
+                found.push_back(entry.path().string());
+            }
+        }
+        std::sort(found.begin(), found.end());
+        files.insert(files.end(), found.begin(), found.end());
+    }
+    return files;
+}
 
-int main() {
+std::optional<PngFilter> ParseFilter(const std::string& name) {
+    static const std::pair<const char*, PngFilter> kFilters[] = {
+        {"adaptive", PngFilter::Adaptive}, {"none", PngFilter::None},
+        {"sub", PngFilter::Sub},           {"up", PngFilter::Up},
+        {"average", PngFilter::Average},   {"paeth", PngFilter::Paeth}};
+    for (const auto& [ filter_name, filter ] : kFilters) {
+        if (name == filter_name) {
+            return filter;
+        }
+    }
+    return std::nullopt;
+}
 
-    for (const std::string& image_name : {"colors.jpg", "bad_quality.jpg", "chroma_halfed.jpg",
-                                   "grayscale.jpg", "lenna.jpg", "save_for_web.jpg", "small.jpg",
-                                   "test.jpg", "tiny.jpg"}) {
+// the whole of text as a number in [min, max]
+std::optional<int> ParseInt(const std::string& text, int min, int max) {
+    int value = 0;
+    const char* end = text.data() + text.size();
+    auto [ pos, error ] = std::from_chars(text.data(), end, value);
+    if (error != std::errc() || pos != end || value < min || value > max) {
+        return std::nullopt;
+    }
+    return value;
+}
 
-        DecodeAndWriteToPng("../jpeg-examples/" + image_name);
+FileResult ConvertToPng(const std::string& filename, const PngOptions& png_options) {
+    FileResult result;
+    result.filename = filename;
+    fs::path png_filename = fs::path(filename).replace_extension(".png");
+    auto start = std::chrono::steady_clock::now();
+    try {
+        MappedFile file(filename);
+        result.input_bytes = file.Size();
+        // rows go to the png as they are decoded, no full image in memory;
+        // the pool already keeps every core busy, so one thread per image
+        PngWriter writer(png_filename.string(), png_options);
+        SizeTracker tracker(&writer);
+        // tables and buffers stay with the worker thread from image to image
+        thread_local DecoderContext context;
+        DecoderOptions options;
+        options.threads = 1;
+        options.context = &context;
+        options.stats = &result.stats;
+        Decode(file.Data(), file.Size(), &tracker, options);
+        result.width = tracker.Width();
+        result.height = tracker.Height();
+    } catch (const std::exception& e) {
+        result.error = e.what();
+        // no half-written pngs
+        std::error_code ignored;
+        fs::remove(png_filename, ignored);
     }
+    result.seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
 
-    return 0;
+std::optional<BatchOptions> ParseArgs(int argc, char** argv) {
+    const int kMaxThreads = 1024;
+    const int kMaxInFlight = 65536;
+    BatchOptions options;
+    for (int ind = 1; ind < argc; ++ind) {
+        std::string arg = argv[ind];
+        bool has_value = ind + 1 < argc;
+        if (arg == "-j" && has_value) {
+            auto threads = ParseInt(argv[++ind], 1, kMaxThreads);
+            if (!threads) {
+                return std::nullopt;
+            }
+            options.threads = *threads;
+        } else if (arg == "--in-flight" && has_value) {
+            auto in_flight = ParseInt(argv[++ind], 1, kMaxInFlight);
+            if (!in_flight) {
+                return std::nullopt;
+            }
+            options.in_flight = *in_flight;
+        } else if (arg == "-z" && has_value) {
+            auto level = ParseInt(argv[++ind], -1, 9);
+            if (!level) {
+                return std::nullopt;
+            }
+            options.png.compression_level = *level;
+        } else if (arg == "--filter" && has_value) {
+            auto filter = ParseFilter(argv[++ind]);
+            if (!filter) {
+                return std::nullopt;
+            }
+            options.png.filter = *filter;
+        } else if (!arg.empty() && arg[0] == '-') {
+            return std::nullopt;
+        } else {
+            options.inputs.push_back(arg);
+        }
+    }
+    if (options.in_flight == 0) {
+        options.in_flight = 2 * options.threads;
+    }
+    if (options.inputs.empty()) {
+        options.inputs.push_back("../jpeg-examples");
+    }
+    return options;
 }
 
+int main(int argc, char** argv) {
+    auto options = ParseArgs(argc, argv);
+    if (!options) {
+        std::cerr << "usage: " << argv[0]
+                  << " [-j threads] [--in-flight images] [-z level] [--filter name]"
+                     " <jpg or directory>...\n"
+                     "threads and images are positive numbers, level is -1 (zlib default) to 9\n"
+                     "filters: adaptive, none, sub, up, average, paeth\n";
+        return 2;
+    }
+    std::vector<std::string> files = CollectFiles(options->inputs);
+    // with fewer images than threads the spare ones deflate png chunks
+    size_t files_num = std::max<size_t>(1, files.size());
+    options->png.threads = std::max<size_t>(1, options->threads / files_num);
+
+    // one image per pipeline token: the source hands out names, workers
+    // decode and encode, results are printed in the order of the files
+    auto pool = MakeThreadPoolExecutor(options->threads);
+    Pipeline pipeline(pool, options->in_flight);
+    size_t next_file = 0;
+    pipeline.setSource<std::string>([&]() -> std::optional<std::string> {
+        if (next_file == files.size()) {
+            return std::nullopt;
+        }
+        return files[next_file++];
+    });
+    pipeline.addStage<std::string, FileResult>(
+        Pipeline::Mode::Parallel,
+        [&](const std::string& filename) { return ConvertToPng(filename, options->png); });
+
+    size_t failed = 0, total_pixels = 0, total_bytes = 0;
+    DecoderStats total_stats;
+    pipeline.addSink<FileResult>(Pipeline::Mode::SerialInOrder, [&](FileResult result) {
+        if (!result.error.empty()) {
+            ++failed;
+            std::cerr << result.filename << ": " << result.error << "\n";
+            return;
+        }
+        size_t pixels = result.width * result.height;
+        total_pixels += pixels;
+        total_bytes += result.input_bytes;
+        total_stats.dc_only_blocks += result.stats.dc_only_blocks;
+        total_stats.low_frequency_blocks += result.stats.low_frequency_blocks;
+        total_stats.full_blocks += result.stats.full_blocks;
+        std::printf("%s: %zux%zu, %.1f ms, %.1f MP/s\n", result.filename.c_str(), result.width,
+                    result.height, result.seconds * 1e3, pixels / result.seconds / 1e6);
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    pipeline.run()->get();
+    double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    pool->startShutdown();
+    pool->waitShutdown();
+
+    std::printf("%zu files, %zu failed, %d threads: %.2f s, %.1f MP/s, %.1f MB/s, %.1f files/s\n",
+                files.size(), failed, options->threads, seconds, total_pixels / seconds / 1e6,
+                total_bytes / seconds / 1e6, files.size() / seconds);
+    size_t blocks = total_stats.dc_only_blocks + total_stats.low_frequency_blocks +
+                    total_stats.full_blocks;
+    if (blocks) {
+        std::printf("blocks: %.1f%% DC only, %.1f%% 4x4, %.1f%% full\n",
+                    100.0 * total_stats.dc_only_blocks / blocks,
+                    100.0 * total_stats.low_frequency_blocks / blocks,
+                    100.0 * total_stats.full_blocks / blocks);
+    }
+    return failed == 0 ? 0 : 1;
+}
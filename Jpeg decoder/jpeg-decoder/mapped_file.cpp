@@ -0,0 +1,44 @@
+#include "mapped_file.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+MappedFile::MappedFile(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Can't open file for reading " + filename);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0) {
+        void* mapping = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            mapping_ = mapping;
+            size_ = file_stat.st_size;
+            data_ = static_cast<const uint8_t*>(mapping);
+            madvise(mapping, size_, MADV_SEQUENTIAL);
+        }
+    }
+    close(fd);
+    if (mapping_) {
+        return;
+    }
+
+    // pipes, empty files and whatever can't be mapped
+    std::ifstream stream(filename, std::ios_base::binary);
+    if (!stream) {
+        throw std::runtime_error("Can't open file for reading " + filename);
+    }
+    buffer_.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+}
+
+MappedFile::~MappedFile() {
+    if (mapping_) {
+        munmap(mapping_, size_);
+    }
+}
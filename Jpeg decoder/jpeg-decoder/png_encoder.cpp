@@ -0,0 +1,412 @@
+#include "png_encoder.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// deflate window, the most of the previous chunk a new one can refer to
+constexpr size_t kDictionarySize = 32768;
+// pigz uses the same block, smaller ones lose ratio on the flush markers
+constexpr size_t kChunkBytes = 131072;
+
+int ColorType(PixelFormat format) {
+    if (format == PixelFormat::Gray) {
+        return PNG_COLOR_TYPE_GRAY;
+    }
+    return format == PixelFormat::Rgba ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB;
+}
+
+int LibpngFilters(PngFilter filter) {
+    switch (filter) {
+        case PngFilter::None:
+            return PNG_FILTER_NONE;
+        case PngFilter::Sub:
+            return PNG_FILTER_SUB;
+        case PngFilter::Up:
+            return PNG_FILTER_UP;
+        case PngFilter::Average:
+            return PNG_FILTER_AVG;
+        case PngFilter::Paeth:
+            return PNG_FILTER_PAETH;
+        default:
+            return PNG_ALL_FILTERS;
+    }
+}
+
+uint8_t PaethPredictor(int left, int up, int up_left) {
+    int estimate = left + up - up_left;
+    int to_left = std::abs(estimate - left);
+    int to_up = std::abs(estimate - up);
+    int to_up_left = std::abs(estimate - up_left);
+    if (to_left <= to_up && to_left <= to_up_left) {
+        return left;
+    }
+    return to_up <= to_up_left ? up : up_left;
+}
+
+// out gets the filter type byte and length residuals; prev is the row above,
+// zeros for the first one
+void ApplyFilter(int type, const uint8_t* row, const uint8_t* prev, size_t length, int bpp,
+                 uint8_t* out) {
+    out[0] = type;
+    ++out;
+    // the first pixel has nothing on the left
+    size_t left = std::min<size_t>(bpp, length);
+    switch (type) {
+        case 0:
+            std::memcpy(out, row, length);
+            break;
+        case 1:
+            std::memcpy(out, row, left);
+            for (size_t ind = left; ind < length; ++ind) {
+                out[ind] = row[ind] - row[ind - bpp];
+            }
+            break;
+        case 2:
+            for (size_t ind = 0; ind < length; ++ind) {
+                out[ind] = row[ind] - prev[ind];
+            }
+            break;
+        case 3:
+            for (size_t ind = 0; ind < left; ++ind) {
+                out[ind] = row[ind] - (prev[ind] >> 1);
+            }
+            for (size_t ind = left; ind < length; ++ind) {
+                out[ind] = row[ind] - ((row[ind - bpp] + prev[ind]) >> 1);
+            }
+            break;
+        default:
+            for (size_t ind = 0; ind < left; ++ind) {
+                out[ind] = row[ind] - prev[ind];
+            }
+            for (size_t ind = left; ind < length; ++ind) {
+                out[ind] = row[ind] - PaethPredictor(row[ind - bpp], prev[ind], prev[ind - bpp]);
+            }
+    }
+}
+
+// residuals as signed bytes, libpng's measure for picking a filter
+size_t ResidualSum(const uint8_t* data, size_t length) {
+    size_t sum = 0;
+    for (size_t ind = 0; ind < length; ++ind) {
+        sum += std::abs(static_cast<int8_t>(data[ind]));
+    }
+    return sum;
+}
+
+void FilterRow(PngFilter filter, const uint8_t* row, const uint8_t* prev, size_t length,
+               int bpp, uint8_t* out, std::vector<uint8_t>* scratch) {
+    if (filter != PngFilter::Adaptive) {
+        ApplyFilter(static_cast<int>(filter) - static_cast<int>(PngFilter::None), row, prev,
+                    length, bpp, out);
+        return;
+    }
+    ApplyFilter(0, row, prev, length, bpp, out);
+    size_t best = ResidualSum(out + 1, length);
+    scratch->resize(length + 1);
+    for (int type = 1; type < 5; ++type) {
+        ApplyFilter(type, row, prev, length, bpp, scratch->data());
+        size_t sum = ResidualSum(scratch->data() + 1, length);
+        if (sum < best) {
+            best = sum;
+            std::memcpy(out, scratch->data(), length + 1);
+        }
+    }
+}
+
+void Put32(uint8_t* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+// calls work(0) ... work(count - 1) spread over at most threads_num threads;
+// the first exception thrown by work is rethrown here once all threads stop
+template <class Work>
+void RunParallel(size_t count, int threads_num, const Work& work) {
+    std::atomic<size_t> next{0};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto run = [&] {
+        try {
+            for (size_t ind; (ind = next++) < count;) {
+                work(ind);
+            }
+        } catch (...) {
+            // the others stop before their next item
+            next = count;
+            std::lock_guard<std::mutex> guard(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t ind = 1; ind < std::min<size_t>(threads_num, count); ++ind) {
+        try {
+            threads.emplace_back(run);
+        } catch (const std::system_error&) {
+            // out of threads, the ones started do the rest
+            break;
+        }
+    }
+    run();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+}  // namespace
+
+// Encodes the image data as a zlib stream made of raw deflate chunks, each
+// one filtered and compressed on its own thread. A chunk ends on a sync
+// flush, so the chunks simply follow each other in IDAT.
+class ChunkedPngStream {
+public:
+    ChunkedPngStream(FILE* fp, size_t width, size_t height, PixelFormat format,
+                     const PngOptions& options)
+        : fp_(fp), options_(options), bpp_(Channels(format)), rows_left_(height) {
+        row_bytes_ = width * bpp_;
+        chunk_rows_ = std::max<size_t>(1, kChunkBytes / (row_bytes_ + 1));
+        // the row in front is the one above the batch, zeros at the top
+        pending_.assign((chunk_rows_ * options_.threads + 1) * row_bytes_, 0);
+
+        static const uint8_t kSignature[] = {137, 80, 78, 71, 13, 10, 26, 10};
+        Write(kSignature, sizeof(kSignature));
+        uint8_t header[13] = {};
+        Put32(header, width);
+        Put32(header + 4, height);
+        header[8] = 8;
+        header[9] = ColorType(format);
+        WriteChunk("IHDR", header, sizeof(header));
+    }
+
+    void AddRows(const uint8_t* data, size_t rows_num, size_t stride) {
+        size_t capacity = chunk_rows_ * options_.threads;
+        for (size_t row = 0; row < rows_num; ++row) {
+            std::memcpy(pending_.data() + (pending_rows_ + 1) * row_bytes_, data + row * stride,
+                        row_bytes_);
+            ++pending_rows_;
+            --rows_left_;
+            if (pending_rows_ == capacity || rows_left_ == 0) {
+                Compress(rows_left_ == 0);
+            }
+        }
+    }
+
+private:
+    struct Chunk {
+        std::vector<uint8_t> filtered, deflated;
+        bool ok = false;
+    };
+
+    void Compress(bool last) {
+        std::vector<Chunk> chunks((pending_rows_ + chunk_rows_ - 1) / chunk_rows_);
+        RunParallel(chunks.size(), options_.threads, [&](size_t ind) {
+            size_t first = ind * chunk_rows_;
+            size_t rows_num = std::min(chunk_rows_, pending_rows_ - first);
+            auto& filtered = chunks[ind].filtered;
+            filtered.resize(rows_num * (row_bytes_ + 1));
+            std::vector<uint8_t> scratch;
+            for (size_t row = 0; row < rows_num; ++row) {
+                const uint8_t* prev = pending_.data() + (first + row) * row_bytes_;
+                FilterRow(options_.filter, prev + row_bytes_, prev, row_bytes_, bpp_,
+                          filtered.data() + row * (row_bytes_ + 1), &scratch);
+            }
+        });
+        // every chunk sees the end of the one before it as history
+        RunParallel(chunks.size(), options_.threads, [&](size_t ind) {
+            const auto& history = ind ? chunks[ind - 1].filtered : dictionary_;
+            size_t history_size = std::min(history.size(), kDictionarySize);
+            bool finish = last && ind + 1 == chunks.size();
+            chunks[ind].ok = Deflate(chunks[ind].filtered,
+                                     history.data() + history.size() - history_size,
+                                     history_size, finish, &chunks[ind].deflated);
+        });
+
+        for (auto& chunk : chunks) {
+            if (!chunk.ok) {
+                throw std::runtime_error("Deflate failed");
+            }
+            adler_ = adler32_combine(adler_, adler32(1, chunk.filtered.data(),
+                                                     chunk.filtered.size()),
+                                     chunk.filtered.size());
+        }
+        if (!started_) {
+            // zlib header in front of the first chunk, FLEVEL only hints the level
+            int level = options_.compression_level;
+            int flevel = level < 0 || level == 6 ? 2 : level < 2 ? 0 : level < 6 ? 1 : 3;
+            uint8_t cmf = 0x78, flg = flevel << 6;
+            flg += 31 - (cmf * 256 + flg) % 31;
+            auto& first = chunks.front().deflated;
+            first.insert(first.begin(), {cmf, flg});
+            started_ = true;
+        }
+        if (last) {
+            uint8_t trailer[4];
+            Put32(trailer, adler_);
+            auto& end = chunks.back().deflated;
+            end.insert(end.end(), trailer, trailer + 4);
+        }
+        for (const auto& chunk : chunks) {
+            WriteChunk("IDAT", chunk.deflated.data(), chunk.deflated.size());
+        }
+
+        dictionary_ = std::move(chunks.back().filtered);
+        std::memcpy(pending_.data(), pending_.data() + pending_rows_ * row_bytes_, row_bytes_);
+        pending_rows_ = 0;
+        if (last) {
+            WriteChunk("IEND", nullptr, 0);
+            if (fflush(fp_) || ferror(fp_)) {
+                throw std::runtime_error("Can't write png");
+            }
+        }
+    }
+
+    bool Deflate(const std::vector<uint8_t>& input, const uint8_t* history, size_t history_size,
+                 bool finish, std::vector<uint8_t>* output) const {
+        z_stream stream{};
+        int strategy = options_.filter == PngFilter::None ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+        if (deflateInit2(&stream, options_.compression_level, Z_DEFLATED, -15, 8, strategy) !=
+            Z_OK) {
+            return false;
+        }
+        if (history_size) {
+            deflateSetDictionary(&stream, history, history_size);
+        }
+        // room for the flush marker on top of the worst case
+        output->resize(deflateBound(&stream, input.size()) + 16);
+        stream.next_in = const_cast<Bytef*>(input.data());
+        stream.avail_in = input.size();
+        stream.next_out = output->data();
+        stream.avail_out = output->size();
+        int flush = finish ? Z_FINISH : Z_SYNC_FLUSH;
+        int result;
+        while ((result = deflate(&stream, flush)) == Z_OK && stream.avail_out == 0) {
+            size_t done = output->size();
+            output->resize(2 * done);
+            stream.next_out = output->data() + done;
+            stream.avail_out = output->size() - done;
+        }
+        output->resize(output->size() - stream.avail_out);
+        deflateEnd(&stream);
+        return finish ? result == Z_STREAM_END : result == Z_OK;
+    }
+
+    void WriteChunk(const char* type, const uint8_t* data, size_t size) {
+        uint8_t length[4];
+        Put32(length, size);
+        Write(length, 4);
+        Write(type, 4);
+        Write(data, size);
+        uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+        // crc32 with a null buffer returns the initial value, not crc
+        if (size) {
+            crc = crc32(crc, data, size);
+        }
+        uint8_t check[4];
+        Put32(check, crc);
+        Write(check, 4);
+    }
+
+    void Write(const void* data, size_t size) {
+        if (size && fwrite(data, 1, size, fp_) != size) {
+            throw std::runtime_error("Can't write png");
+        }
+    }
+
+    FILE* fp_;
+    PngOptions options_;
+    int bpp_;
+    size_t row_bytes_, chunk_rows_;
+    size_t rows_left_;
+    std::vector<uint8_t> pending_;
+    size_t pending_rows_ = 0;
+    std::vector<uint8_t> dictionary_;
+    uLong adler_ = 1;
+    bool started_ = false;
+};
+
+void WritePng(const std::string& filename, const uint8_t* pixels, size_t width, size_t height,
+              size_t stride, PixelFormat format, const PngOptions& options) {
+    PngWriter writer(filename, options);
+    writer.Start(width, height, format);
+    writer.WriteRows(0, height, pixels, stride);
+}
+
+void WritePng(const std::string& filename, const Image& image, const PngOptions& options) {
+    WritePng(filename, image.Data(), image.Width(), image.Height(), image.Stride(),
+             image.Format(), options);
+}
+
+PngWriter::PngWriter(const std::string& filename, const PngOptions& options)
+    : options_(options) {
+    options_.threads = std::max(1, options_.threads);
+    fp_ = fopen(filename.c_str(), "wb");
+    if (!fp_) {
+        throw std::runtime_error("Can't open file for writing " + filename);
+    }
+}
+
+PngWriter::~PngWriter() {
+    if (png_) {
+        png_destroy_write_struct(&png_, &info_);
+    }
+    fclose(fp_);
+}
+
+void PngWriter::Start(size_t width, size_t height, PixelFormat format) {
+    // png has no empty images, the threaded path would write IHDR alone
+    if (width == 0 || height == 0) {
+        throw std::runtime_error("Png image must not be empty");
+    }
+    rows_left_ = height;
+    if (options_.threads > 1) {
+        chunked_ = std::make_unique<ChunkedPngStream>(fp_, width, height, format, options_);
+        return;
+    }
+    png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info_ = png_create_info_struct(png_);
+    if (setjmp(png_jmpbuf(png_))) {
+        throw std::runtime_error("Shit happens");
+    }
+    png_init_io(png_, fp_);
+    png_set_compression_level(png_, options_.compression_level);
+    png_set_filter(png_, PNG_FILTER_TYPE_BASE, LibpngFilters(options_.filter));
+    png_set_IHDR(png_, info_, width, height, 8, ColorType(format), PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_, info_);
+}
+
+void PngWriter::WriteRows(size_t, size_t rows_num, const uint8_t* data, size_t stride) {
+    if (chunked_) {
+        chunked_->AddRows(data, rows_num, stride);
+        return;
+    }
+    if (setjmp(png_jmpbuf(png_))) {
+        throw std::runtime_error("Shit happens");
+    }
+    // libpng doesn't write through the rows
+    for (size_t row = 0; row < rows_num; ++row) {
+        png_write_row(png_, const_cast<png_bytep>(data + row * stride));
+    }
+    rows_left_ -= rows_num;
+    if (rows_left_ == 0) {
+        png_write_end(png_, NULL);
+    }
+}
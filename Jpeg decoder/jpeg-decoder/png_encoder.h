@@ -3,47 +3,61 @@
 #include "image.h"
 #include <png.h>
 
-#include <stdexcept>
+#include <cstdio>
+#include <memory>
 #include <string>
 
-void WritePng(const std::string& filename, const Image& image) {
-    FILE* fp = fopen(filename.c_str(), "wb");
-    if (!fp) {
-        throw std::runtime_error("Can't open file for writing " + filename);
-    }
-    png_structp png =
-        png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    png_infop info = png_create_info_struct(png);
-    if (setjmp(png_jmpbuf(png))) {
-        throw std::runtime_error("Shit happens");
-    }
-
-    png_init_io(png, fp);
-
-    png_set_IHDR(png, info, image.Width(), image.Height(), 8,
-                 PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png, info);
-
-    png_bytep* bytes = (png_bytep*)malloc(sizeof(png_bytep) * image.Height());
-    for (size_t y = 0; y < image.Height(); y++) {
-        bytes[y] = (png_byte*)malloc(png_get_rowbytes(png, info));
-        for (size_t x = 0; x < image.Width(); ++x) {
-            auto pixel = image.GetPixel(y, x);
-            bytes[y][x * 4] = pixel.r;
-            bytes[y][x * 4 + 1] = pixel.g;
-            bytes[y][x * 4 + 2] = pixel.b;
-            bytes[y][x * 4 + 3] = 255;
-        }
-    }
-    png_write_image(png, bytes);
-    png_write_end(png, NULL);
-
-    fclose(fp);
-    png_destroy_write_struct(&png, &info);
-
-    for (size_t i = 0; i < image.Height(); ++i) {
-        free(bytes[i]);
-    }
-    free(bytes);
-}
+// per row prediction written before deflate
+enum class PngFilter {
+    // the filter with the smallest sum of absolute residuals, row by row
+    Adaptive,
+    None,
+    Sub,
+    Up,
+    Average,
+    Paeth
+};
+
+struct PngOptions {
+    // zlib level from 0 (stored) to 9, -1 is zlib's default
+    int compression_level = -1;
+    PngFilter filter = PngFilter::Adaptive;
+    // more than one deflates chunks of rows on that many threads; every chunk
+    // is primed with the tail of the previous one, so the file stays close to
+    // the single stream one
+    int threads = 1;
+};
+
+// rows are read from the buffer in place, stride bytes apart
+void WritePng(const std::string& filename, const uint8_t* pixels, size_t width, size_t height,
+              size_t stride, PixelFormat format, const PngOptions& options = {});
+
+void WritePng(const std::string& filename, const Image& image, const PngOptions& options = {});
+
+class ChunkedPngStream;
+
+// Writes rows to a png file as they come, the file is complete once all
+// rows are written.
+class PngWriter : public ScanlineSink {
+public:
+    explicit PngWriter(const std::string& filename, const PngOptions& options = {});
+
+    PngWriter(const PngWriter&) = delete;
+    PngWriter& operator=(const PngWriter&) = delete;
+
+    ~PngWriter() override;
+
+    void Start(size_t width, size_t height, PixelFormat format) override;
+
+    void WriteRows(size_t first_row, size_t rows_num, const uint8_t* data,
+                   size_t stride) override;
+
+private:
+    PngOptions options_;
+    FILE* fp_;
+    png_structp png_ = nullptr;
+    png_infop info_ = nullptr;
+    // the threaded path writes the file itself, libpng has a single stream
+    std::unique_ptr<ChunkedPngStream> chunked_;
+    size_t rows_left_ = 0;
+};
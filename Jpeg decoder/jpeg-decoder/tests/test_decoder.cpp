@@ -0,0 +1,80 @@
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include "check.h"
+#include "decoder.h"
+
+namespace {
+const std::string kProgressive = std::string(TEST_DATA_DIR) + "/progressive.jpg";
+
+void ExpectCropOf(const Image& full, const Rect& rect, const Image& crop) {
+    CHECK(crop.Width() == static_cast<size_t>(rect.width));
+    CHECK(crop.Height() == static_cast<size_t>(rect.height));
+    size_t channels = Channels(full.Format());
+    for (int y = 0; y < rect.height; ++y) {
+        CHECK(std::memcmp(full.Row(rect.y + y) + rect.x * channels, crop.Row(y),
+                          crop.Stride()) == 0);
+    }
+}
+}  // namespace
+
+void TestDcPreviewSize() {
+    DecoderOptions options;
+    options.dc_preview = true;
+    auto preview = Decode(kProgressive, options);
+    CHECK(preview.Width() == 26u);
+    CHECK(preview.Height() == 18u);
+}
+
+// the crop is given at options.scale, the preview takes the blocks it touches
+void TestDcPreviewWithCrop() {
+    DecoderOptions options;
+    options.dc_preview = true;
+    auto full = Decode(kProgressive, options);
+
+    struct Case {
+        int scale;
+        Rect crop, preview;
+    };
+    std::vector<Case> cases = {{1, {37, 21, 100, 70}, {4, 2, 14, 10}},
+                               {1, {100, 70, 103, 71}, {12, 8, 14, 10}},
+                               {1, {0, 0, 8, 8}, {0, 0, 1, 1}},
+                               {2, {18, 10, 50, 35}, {4, 2, 13, 10}},
+                               {8, {3, 4, 20, 10}, {3, 4, 20, 10}}};
+    for (const auto& test : cases) {
+        options.scale = test.scale;
+        options.crop = test.crop;
+        auto preview = Decode(kProgressive, options);
+        ExpectCropOf(full, test.preview, preview);
+    }
+}
+
+void TestCropOutOfImageFails() {
+    DecoderOptions options;
+    options.dc_preview = true;
+    options.crop = Rect{200, 0, 10, 10};
+    CHECK(Throws<std::runtime_error>([&]() { Decode(kProgressive, options); }));
+}
+
+// a failed decode into a reused image must not take the image's buffer away
+void TestFailedDecodeKeepsImage() {
+    Image image;
+    Decode(kProgressive, &image);
+    const uint8_t* buffer = image.Data();
+    size_t width = image.Width();
+
+    std::ifstream file(kProgressive, std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+    data.resize(data.size() / 2);
+    CHECK(Throws<std::runtime_error>([&]() { Decode(data.data(), data.size(), &image); }));
+    CHECK(image.Data() == buffer);
+    CHECK(image.Width() == width);
+}
+
+int main() {
+    return RunTests({{"Decoder.DcPreviewSize", TestDcPreviewSize},
+                     {"Decoder.DcPreviewWithCrop", TestDcPreviewWithCrop},
+                     {"Decoder.CropOutOfImageFails", TestCropOutOfImageFails},
+                     {"Decoder.FailedDecodeKeepsImage", TestFailedDecodeKeepsImage}});
+}
@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include "check.h"
+#include "decoder.h"
+#include "idct.h"
+
+namespace {
+const double kPi = std::acos(-1.0);
+
+// straight from the definition in double precision, samples rounded and
+// clamped the way the decoder stores them
+void ReferenceIdct(const int16_t* coefs, const uint16_t* quant, uint8_t* out) {
+    for (int y = 0; y < 8; ++y) {
+        for (int x = 0; x < 8; ++x) {
+            double sum = 0;
+            for (int v = 0; v < 8; ++v) {
+                for (int u = 0; u < 8; ++u) {
+                    double cu = u ? 1 : std::sqrt(0.5);
+                    double cv = v ? 1 : std::sqrt(0.5);
+                    sum += cu * cv * coefs[v * 8 + u] * quant[v * 8 + u] *
+                           std::cos((2 * x + 1) * u * kPi / 16) *
+                           std::cos((2 * y + 1) * v * kPi / 16);
+                }
+            }
+            out[y * 8 + x] = std::clamp<long>(std::lround(sum / 4) + 128, 0, 255);
+        }
+    }
+}
+
+// coefficients of a plausible block: dequantized values stay in the 12-bit
+// range of 8-bit jpegs, higher frequencies are sparser and smaller
+struct BlockGenerator {
+    void Next(int16_t* coefs, uint16_t* quant) {
+        std::uniform_int_distribution<int> quant_value(1, 64);
+        std::uniform_int_distribution<int> percent(0, 99);
+        int density = percent(random);
+        for (int ind = 0; ind < 64; ++ind) {
+            int u = ind % 8, v = ind / 8;
+            quant[ind] = quant_value(random);
+            coefs[ind] = 0;
+            if (ind && percent(random) >= density / (1 + (u + v) / 4)) {
+                continue;
+            }
+            int limit = std::max(1, (ind ? 1023 : 2047) / quant[ind] / (1 + u + v));
+            coefs[ind] = std::uniform_int_distribution<int>(-limit, limit)(random);
+        }
+    }
+
+    std::mt19937 random{20261019};
+};
+
+// every level up to the best one this CPU and build can do
+std::vector<SimdLevel> SupportedLevels() {
+    std::vector<SimdLevel> levels;
+    for (auto level : {SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Avx2}) {
+        if (level <= BestSimdLevel()) {
+            levels.push_back(level);
+        }
+    }
+    return levels;
+}
+
+std::vector<std::string> SampleFiles() {
+    std::vector<std::string> files = {std::string(TEST_DATA_DIR) + "/progressive.jpg"};
+    for (const auto& entry : std::filesystem::directory_iterator(EXAMPLES_DIR)) {
+        if (entry.path().extension() == ".jpg") {
+            files.push_back(entry.path().string());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+bool SameImage(const Image& first, const Image& second) {
+    return first.Width() == second.Width() && first.Height() == second.Height() &&
+           first.Format() == second.Format() &&
+           std::memcmp(first.Data(), second.Data(), first.Stride() * first.Height()) == 0;
+}
+}  // namespace
+
+void TestIntegerIdctAccuracy() {
+    BlockGenerator generator;
+    int16_t coefs[64];
+    uint16_t quant[64];
+    uint8_t expected[64], actual[64];
+    int max_error = 0;
+    double total_error = 0;
+    const int kBlocks = 20000;
+    for (int block = 0; block < kBlocks; ++block) {
+        generator.Next(coefs, quant);
+        ReferenceIdct(coefs, quant, expected);
+        IdctScalar(coefs, quant, actual, 8);
+        for (int ind = 0; ind < 64; ++ind) {
+            int error = std::abs(expected[ind] - actual[ind]);
+            max_error = std::max(max_error, error);
+            total_error += error;
+        }
+    }
+    CHECK(max_error <= 1);
+    // off by one now and then, not on every other sample
+    CHECK(total_error / (kBlocks * 64) < 0.05);
+}
+
+void TestSimdKernelsMatchScalar() {
+    BlockGenerator generator;
+    int16_t coefs[64];
+    uint16_t quant[64];
+    uint8_t expected[64], actual[64];
+    auto levels = SupportedLevels();
+    for (int block = 0; block < 100000; ++block) {
+        generator.Next(coefs, quant);
+        IdctScalar(coefs, quant, expected, 8);
+        for (auto level : levels) {
+            GetIdct(level)(coefs, quant, actual, 8);
+            CHECK(std::memcmp(expected, actual, 64) == 0);
+        }
+    }
+}
+
+void TestSimdLevelsDecodeTheSame() {
+    auto levels = SupportedLevels();
+    for (const auto& file : SampleFiles()) {
+        DecoderOptions options;
+        options.simd_level = SimdLevel::Scalar;
+        auto expected = Decode(file, options);
+        for (auto level : levels) {
+            options.simd_level = level;
+            CHECK(SameImage(expected, Decode(file, options)));
+        }
+    }
+}
+
+// the shortcuts must give the samples of the full transform at every level
+void TestSparseShortcutsMatchFullTransform() {
+    BlockGenerator generator;
+    int16_t coefs[64];
+    uint16_t quant[64];
+    uint8_t expected[64], actual[64];
+    auto levels = SupportedLevels();
+    for (int block = 0; block < 50000; ++block) {
+        generator.Next(coefs, quant);
+        // DC only
+        std::fill(coefs + 1, coefs + 64, 0);
+        IdctDcOnly(coefs, quant, actual, 8);
+        for (auto level : levels) {
+            GetIdct(level)(coefs, quant, expected, 8);
+            CHECK(std::memcmp(expected, actual, 64) == 0);
+        }
+
+        // only the top left 4x4 frequencies
+        generator.Next(coefs, quant);
+        for (int ind = 0; ind < 64; ++ind) {
+            if (ind % 8 >= 4 || ind / 8 >= 4) {
+                coefs[ind] = 0;
+            }
+        }
+        for (auto level : levels) {
+            GetIdct(level)(coefs, quant, expected, 8);
+            GetLowFrequencyIdct(level)(coefs, quant, actual, 8);
+            CHECK(std::memcmp(expected, actual, 64) == 0);
+        }
+    }
+}
+
+// which shortcut every block of a known file takes
+void TestDecoderStats() {
+    struct Case {
+        const char* name;
+        size_t dc_only, low_frequency, full;
+    };
+    for (const auto& test : {Case{"bad_quality.jpg", 14279, 2910, 171},
+                             Case{"grayscale.jpg", 2588, 11, 3026},
+                             Case{"lenna.jpg", 0, 0, 12288}}) {
+        for (auto level : SupportedLevels()) {
+            DecoderStats stats;
+            DecoderOptions options;
+            options.simd_level = level;
+            options.stats = &stats;
+            Decode(std::string(EXAMPLES_DIR) + "/" + test.name, options);
+            CHECK(stats.dc_only_blocks == test.dc_only);
+            CHECK(stats.low_frequency_blocks == test.low_frequency);
+            CHECK(stats.full_blocks == test.full);
+        }
+    }
+}
+
+void TestUnsupportedLevelThrows() {
+    if (BestSimdLevel() != SimdLevel::Avx2) {
+        CHECK(Throws<std::runtime_error>([]() { GetIdct(SimdLevel::Avx2); }));
+    }
+}
+
+#ifdef JPEG_DECODER_WITH_FFTW
+// gray output has no color conversion on top, so only the transforms differ
+void TestIntegerIdctMatchesFftw() {
+    for (const char* name : {"grayscale.jpg", "lenna.jpg", "bad_quality.jpg"}) {
+        DecoderOptions options;
+        options.pixel_format = PixelFormat::Gray;
+        auto integer = Decode(std::string(EXAMPLES_DIR) + "/" + name, options);
+        options.idct_method = IdctMethod::Fftw;
+        auto fftw = Decode(std::string(EXAMPLES_DIR) + "/" + name, options);
+        CHECK(integer.Width() == fftw.Width() && integer.Height() == fftw.Height());
+        for (size_t y = 0; y < integer.Height(); ++y) {
+            for (size_t x = 0; x < integer.Width(); ++x) {
+                CHECK(std::abs(integer.Row(y)[x] - fftw.Row(y)[x]) <= 1);
+            }
+        }
+    }
+}
+#endif
+
+int main() {
+    return RunTests({
+        {"Idct.IntegerIdctAccuracy", TestIntegerIdctAccuracy},
+        {"Idct.SimdKernelsMatchScalar", TestSimdKernelsMatchScalar},
+        {"Idct.SimdLevelsDecodeTheSame", TestSimdLevelsDecodeTheSame},
+        {"Idct.SparseShortcutsMatchFullTransform", TestSparseShortcutsMatchFullTransform},
+        {"Idct.DecoderStats", TestDecoderStats},
+        {"Idct.UnsupportedLevelThrows", TestUnsupportedLevelThrows},
+#ifdef JPEG_DECODER_WITH_FFTW
+        {"Idct.IntegerIdctMatchesFftw", TestIntegerIdctMatchesFftw},
+#endif
+    });
+}
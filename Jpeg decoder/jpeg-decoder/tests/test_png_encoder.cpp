@@ -0,0 +1,120 @@
+#include <png.h>
+#include <cstdio>
+#include <cstring>
+#include "check.h"
+#include "png_encoder.h"
+
+namespace {
+Image MakeGradient(size_t width, size_t height, PixelFormat format) {
+    Image image(width, height, format);
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            image.SetPixel(y, x, {int(x * 255 / width), int(y * 255 / height),
+                                  int((x * y) % 256)});
+        }
+    }
+    return image;
+}
+
+// reads the whole file with libpng, IEND and every CRC included; false on
+// any libpng error
+bool ReadPng(const std::string& filename, Image* image) {
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png_create_info_struct(png);
+    png_infop end_info = png_create_info_struct(png);
+    std::vector<png_bytep> rows;
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, &end_info);
+        fclose(fp);
+        return false;
+    }
+    png_init_io(png, fp);
+    png_read_info(png, info);
+    int color_type = png_get_color_type(png, info);
+    PixelFormat format = color_type == PNG_COLOR_TYPE_GRAY  ? PixelFormat::Gray
+                         : color_type == PNG_COLOR_TYPE_RGB ? PixelFormat::Rgb
+                                                            : PixelFormat::Rgba;
+    image->SetSize(png_get_image_width(png, info), png_get_image_height(png, info), format);
+    for (size_t y = 0; y < image->Height(); ++y) {
+        rows.push_back(image->Row(y));
+    }
+    png_read_image(png, rows.data());
+    png_read_end(png, end_info);
+    png_destroy_read_struct(&png, &info, &end_info);
+    fclose(fp);
+    return true;
+}
+
+void ExpectSame(const Image& expected, const Image& actual) {
+    CHECK(expected.Width() == actual.Width());
+    CHECK(expected.Height() == actual.Height());
+    CHECK(expected.Format() == actual.Format());
+    for (size_t y = 0; y < expected.Height(); ++y) {
+        CHECK(std::memcmp(expected.Row(y), actual.Row(y), expected.Stride()) == 0);
+    }
+}
+}  // namespace
+
+void TestSingleStreamReadsBack() {
+    auto image = MakeGradient(300, 200, PixelFormat::Rgb);
+    WritePng("png_single.png", image);
+    Image read;
+    CHECK(ReadPng("png_single.png", &read));
+    ExpectSame(image, read);
+}
+
+// chunks, the zlib trailer and IEND are written by hand on this path
+void TestThreadedReadsBackToEnd() {
+    for (auto format : {PixelFormat::Gray, PixelFormat::Rgb, PixelFormat::Rgba}) {
+        for (auto filter : {PngFilter::Adaptive, PngFilter::None, PngFilter::Sub, PngFilter::Up,
+                            PngFilter::Average, PngFilter::Paeth}) {
+            // several chunks of rows per thread
+            auto image = MakeGradient(1000, 700, format);
+            PngOptions options;
+            options.threads = 4;
+            options.filter = filter;
+            WritePng("png_threaded.png", image, options);
+            Image read;
+            CHECK(ReadPng("png_threaded.png", &read));
+            ExpectSame(image, read);
+        }
+    }
+}
+
+void TestThreadedRowByRow() {
+    auto image = MakeGradient(517, 301, PixelFormat::Rgb);
+    PngOptions options;
+    options.threads = 3;
+    options.compression_level = 1;
+    {
+        PngWriter writer("png_rows.png", options);
+        writer.Start(image.Width(), image.Height(), image.Format());
+        for (size_t y = 0; y < image.Height(); ++y) {
+            writer.WriteRows(y, 1, image.Row(y), image.Stride());
+        }
+    }
+    Image read;
+    CHECK(ReadPng("png_rows.png", &read));
+    ExpectSame(image, read);
+}
+
+void TestEmptyImageFails() {
+    for (int threads : {1, 4}) {
+        PngOptions options;
+        options.threads = threads;
+        PngWriter writer("png_empty.png", options);
+        CHECK(Throws<std::runtime_error>([&]() { writer.Start(0, 10, PixelFormat::Rgb); }));
+        CHECK(Throws<std::runtime_error>([&]() { writer.Start(10, 0, PixelFormat::Rgb); }));
+    }
+}
+
+int main() {
+    return RunTests({{"PngEncoder.SingleStreamReadsBack", TestSingleStreamReadsBack},
+                     {"PngEncoder.ThreadedReadsBackToEnd", TestThreadedReadsBackToEnd},
+                     {"PngEncoder.ThreadedRowByRow", TestThreadedRowByRow},
+                     {"PngEncoder.EmptyImageFails", TestEmptyImageFails}});
+}